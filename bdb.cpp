@@ -9,113 +9,703 @@
  will report on the root file system, not everything under its
  directory structure.  Likewise, bdb purposely avoids symlinks.
 
+ Directories are scheduled breadth first onto a bounded frontier so
+ that all threads have work, then depth first once it is full.  Open
+ directory handles are limited to what RLIMIT_NOFILE allows.
+
  options:
     -threads N  (number of threads, default 4)
-    -size N (minimum GB of interest, default 1)
+    -size N (minimum GB of interest, default 1, or N% of the space used
+	     on the filesystem; a comma separated list prints one report
+	     per size from the same scan)
+    -parent-percent N (only directories at least N% of their parent)
+    -max-depth N (keep directories at most N levels down, still counting
+		  everything beneath them)
+    -frontier N (maximum queued directories, default 4096)
+    -max-fds N (maximum open directories, default from RLIMIT_NOFILE)
+    -max-memory MB (keep the queue and retained tree near MB, folding
+		    smaller directories into their parents when over)
+    -prefetch N (read ahead up to N waiting directories, default off)
+    -image FILE (read an ext2/3/4 image; the directory argument names
+                 the path the image would be mounted at)
+    -no-elision (print single-child chains in full)
+    -summary (print scan statistics and high-water marks to stderr)
+    -reconcile (compare the total with statvfs and list deleted files
+                still held open, found through /proc)
+    -histogram (print log2 file size histograms of reported directories)
+    -slack (report block tail and preallocation waste)
+    -compress MB (estimate compressibility of files of at least MB)
+    -sparse MB (count zero-filled blocks in files of at least MB)
+    -chargeback RULES (bytes and inodes per cost center, see chargeback.cpp)
+    -io-budget MB (most file contents to read for estimates, default 1024)
+    -snapshot FILE (save the retained tree for later comparison)
+    -update FILE (rescan only the given directory and update that
+		  snapshot of a tree above it in place)
+    -cache DIR (publish the result there for other runs to share)
+    -max-age SECONDS (use a result in the -cache at most this old, or
+		      wait for a run in progress, instead of scanning)
+    -watch SECONDS (after the report, keep it current with inotify and
+		    print it again every SECONDS if anything changed)
+    -columnar FILE (export the retained tree in columnar binary form)
+    -record FILE (save the anonymized shape of the scanned tree)
+    -compare FILE (print only directories grown since that snapshot)
+    -growth N (least growth to print, in GB or with '%' percent)
+    -growth-limit N (exit with status 2 if any directory grows by N)
+    -explain P OLD NEW (fewest deep directories accounting for P percent
+                        of the growth between two snapshots)
+
+
+ bdb merge [-threads N] [-top N] SNAPSHOT...
+    combines snapshots of many hosts, printing per path the total, the
+    largest host's share, the number of hosts and the top N hosts.
+
+ bdb search [-threads N] PATTERN COLUMNAR...
+    prints the directories in -columnar files whose name contains
+    PATTERN, or matches it if it is a glob, with their sizes.
+
+ bdb replay [-threads N] [-frontier N] [-max-fds N] [-prefetch N]
+	    [-summary] SHAPE
+    replays a -record shape through the scanner, with each directory
+    taking its recorded time, and prints how long the whole took.
+
+ bdb materialize SHAPE DIR
+    builds a tree of that shape, with sparse files, under DIR.
 
 **********************************************************************/
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <future>
 #include <iomanip>
 #include <mutex>
 #include <queue>
-#include <vector>
+#include <thread>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 
-const size_t GB = 1024 * 1024 * 1024;
+#include "bdb.h"
 
-struct Node;
-using NodePtr = std::shared_ptr<Node>;
+/*
+ * A directory between discovery and completion.  Its node is final once
+ * its own listing is done and every child it handed off has reported
+ * back; only then can we tell whether it is large enough to retain.
+ */
+struct Work;
+using WorkPtr = std::shared_ptr<Work>;
 
-struct Node {
-    std::string fullpath;
-    size_t size;
-    std::vector<NodePtr> children;
+struct Work {
+    Node node;
+    WorkPtr parent;
+    int depth;
+    Chargeback::Match charge; // cost center, with -chargeback
+    size_t shape_id;          // directory number, with -record
+    std::atomic<int> outstanding; // own listing plus unfinished children
+    std::atomic<bool> started{false};
+    std::mutex m;
 };
 
-static NodePtr
-traverse_directory(const std::string dir, const dev_t device,
-                   const std::function<NodePtr(std::string, dev_t)> f) {
-    auto result = std::make_shared<Node>();
-    result->fullpath = dir;
+static void raise_max(std::atomic<size_t> &peak, const size_t value) {
+    auto seen = peak.load();
+    while (value > seen && !peak.compare_exchange_weak(seen, value)) {
+    }
+}
 
-    auto dirp = opendir(dir.c_str());
+/*
+ * Claims one of the -max-fds descriptors beyond those the workers
+ * always hold, for descending with the parent still open or for
+ * prefetching; the caller gives it back by decrementing open_fds.
+ */
+static bool reserve_directory_fd(Stats *stats) {
+    auto open = stats->open_fds.load();
+    do {
+	if (open >= stats->fd_limit) {
+	    return false;
+	}
+    } while (!stats->open_fds.compare_exchange_weak(open, open + 1));
+    raise_max(stats->open_fds_peak, open + 1);
+    return true;
+}
 
-    if (dirp) {
+/*
+ * Reads directories that a worker will reach later so that, on a cold
+ * cache, their blocks and inodes are already in memory when it does.
+ * Only directories waiting on the frontier or deferred by their parent
+ * are offered, and at most a window of them at a time; entries whose
+ * worker got there first are dropped unread.
+ */
+class Prefetcher {
+  public:
+    Prefetcher(const size_t window, const int threads, Lister &lister,
+	       Stats *stats)
+	: window(window), lister(lister), stats(stats) {
+	for (int i = 0; window && i < threads; i++) {
+	    pool.emplace_back([this]() {
+		for (std::string dir; next(dir);) {
+		    // the workers' descriptors come first; skip when short
+		    if (!reserve_directory_fd(this->stats)) {
+			continue;
+		    }
+		    this->lister.warm(dir);
+		    this->stats->open_fds--;
+		    this->stats->prefetched++;
+		}
+	    });
+	}
+    }
+
+    ~Prefetcher() {
+	{
+	    std::lock_guard<std::mutex> guard(m);
+	    stopping = true;
+	}
+	cv.notify_all();
+	for (auto &t : pool) {
+	    t.join();
+	}
+    }
 
-	dirent *entry;
+    void offer(const WorkPtr &w) {
+	if (!window) {
+	    return;
+	}
+	std::lock_guard<std::mutex> guard(m);
+	if (pending.size() < window) {
+	    // the path is copied now: once scanned, the node moves away
+	    pending.emplace_back(w->node.fullpath, w);
+	    cv.notify_one();
+	}
+    }
 
-	while ((entry = readdir(dirp)) != 0) {
+  private:
+    const size_t window;
+    Lister &lister;
+    Stats *stats;
+    std::vector<std::thread> pool;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::pair<std::string, WorkPtr>> pending;
+    bool stopping = false;
 
-	    std::string name = entry->d_name;
+    bool next(std::string &dir) {
+	std::unique_lock<std::mutex> lock(m);
+	for (;;) {
+	    cv.wait(lock, [this]() { return !pending.empty() || stopping; });
+	    if (stopping) {
+		return false;
+	    }
+	    auto entry = std::move(pending.front());
+	    pending.pop_front();
+	    if (!entry.second->started) {
+		dir = std::move(entry.first);
+		return true;
+	    }
+	    stats->prefetch_late++;
+	}
+    }
+};
 
-	    if (name == "" || name == "." || name == "..") {
+class FilesystemLister : public Lister {
+  public:
+    void list(const std::string &dir,
+	      const std::function<void(const Entry &)> &each) override {
+	auto dirp = opendir(dir.c_str());
+	if (!dirp) {
+	    return;
+	}
+	Entry e;
+	for (dirent *entry; (entry = readdir(dirp)) != 0;) {
+	    const char *name = entry->d_name;
+	    if (!strcmp(name, "") || !strcmp(name, ".") || !strcmp(name, "..")) {
 		continue;
 	    }
+	    e.path = dir + (dir.back() == '/' ? "" : "/") + name;
+	    if (lstat(e.path.c_str(), &e.buf)) {
+		continue;
+	    }
+	    e.type = entry->d_type;
+	    each(e);
+	}
+	closedir(dirp);
+    }
 
-	    const auto path = dir + (dir.back() == '/' ? "" : "/") + name;
+    void warm(const std::string &dir) override {
+	auto dirp = opendir(dir.c_str());
+	if (!dirp) {
+	    return;
+	}
+	const int fd = dirfd(dirp);
+	struct stat buf;
+	for (dirent *entry; (entry = readdir(dirp)) != 0;) {
+	    fstatat(fd, entry->d_name, &buf, AT_SYMLINK_NOFOLLOW);
+	}
+	closedir(dirp);
+    }
+};
 
-	    struct stat buf;
-	    if (lstat(path.c_str(), &buf) || buf.st_dev != device) {
-		continue;
+/*
+ * Hybrid breadth/depth scheduler.  Newly found directories go onto a
+ * shared frontier while it has room, which keeps every worker busy.
+ * Once the frontier is full a worker descends into the directory itself
+ * with its parent still open, and once the open directory budget is
+ * spent as well it finishes reading the parent before descending.
+ */
+class Scanner {
+  public:
+    Scanner(const dev_t device, const size_t block, const Options &opts,
+	    Stats *stats, Lister &lister)
+	: device(device), block(block), opts(opts), stats(stats),
+	  lister(lister), prefetcher(opts.prefetch, opts.threads, lister, stats) {}
+
+    NodePtr run(const std::string &dir) {
+	auto root = std::make_shared<Work>();
+	root->node.fullpath = dir;
+	root->depth = 0;
+	root->outstanding = 1;
+	stats->retain_floor = opts.retain;
+	account(stats->work_memory, work_cost(*root));
+	if (opts.chargeback) {
+	    root->charge = opts.chargeback->start(dir);
+	}
+	if (opts.recorder) {
+	    root->shape_id = opts.recorder->add(ShapeRecorder::NONE);
+	}
+
+	push(root);
+
+	// each worker always holds a descriptor for the directory it took
+	// from the frontier, or for a deferred child once that is closed
+	raise_max(stats->open_fds_peak, stats->open_fds += opts.threads);
+
+	std::vector<std::future<void>> futures;
+	for (int i = 0; i < opts.threads; i++) {
+	    futures.emplace_back(std::async(std::launch::async, [this]() {
+		for (WorkPtr w; next(w);) {
+		    scan(w);
+		    done();
+		}
+	    }));
+	}
+	for (auto &f : futures) {
+	    f.get();
+	}
+	stats->open_fds -= opts.threads;
+
+	return result;
+    }
+
+  private:
+    const dev_t device;
+    const size_t block; // filesystem allocation unit
+    const Options &opts;
+    Stats *stats;
+    Lister &lister;
+    Prefetcher prefetcher;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<WorkPtr> frontier;
+    size_t active = 0; // frontier entries queued or being scanned
+    NodePtr result;
+
+    void push(const WorkPtr &w) {
+	std::lock_guard<std::mutex> guard(m);
+	frontier.push_back(w);
+	active++;
+	stats->frontier_peak = std::max(stats->frontier_peak, frontier.size());
+	cv.notify_one();
+    }
+
+    bool offer(const WorkPtr &w) {
+	std::lock_guard<std::mutex> guard(m);
+	if (frontier.size() >= opts.frontier) {
+	    return false;
+	}
+	// over its share of -max-memory the queue stops growing, and
+	// workers go depth first with what they hold
+	if (opts.max_memory && stats->work_memory > opts.max_memory / 2) {
+	    return false;
+	}
+	frontier.push_back(w);
+	active++;
+	stats->frontier_peak = std::max(stats->frontier_peak, frontier.size());
+	cv.notify_one();
+	prefetcher.offer(w);
+	return true;
+    }
+
+    bool next(WorkPtr &w) {
+	std::unique_lock<std::mutex> lock(m);
+	cv.wait(lock, [this]() { return !frontier.empty() || active == 0; });
+	if (frontier.empty()) {
+	    return false;
+	}
+	w = frontier.front();
+	frontier.pop_front();
+	return true;
+    }
+
+    void done() {
+	std::lock_guard<std::mutex> guard(m);
+	if (--active == 0) {
+	    cv.notify_all();
+	}
+    }
+
+    WorkPtr child_of(const WorkPtr &parent, const std::string &path) {
+	auto w = std::make_shared<Work>();
+	w->node.fullpath = path;
+	w->parent = parent;
+	w->depth = parent->depth + 1;
+	w->outstanding = 1;
+	parent->outstanding++;
+	account(stats->work_memory, work_cost(*w));
+	if (opts.chargeback) {
+	    w->charge = opts.chargeback->descend(
+		parent->charge, path.substr(path.rfind('/') + 1));
+	}
+	if (opts.recorder) {
+	    w->shape_id = opts.recorder->add(parent->shape_id);
+	}
+	return w;
+    }
+
+    bool reserve_fd() { return reserve_directory_fd(stats); }
+
+    void descend(const WorkPtr &child) {
+	if (!offer(child)) {
+	    scan(child);
+	}
+    }
+
+    void scan(const WorkPtr &w) {
+	const auto &dir = w->node.fullpath;
+	std::vector<WorkPtr> deferred;
+	w->started = true;
+	Node own = Node();
+	size_t files = 0;
+	ShapeRecorder::Directory shape;
+	const auto began = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration nested{0}; // in inline children
+
+	lister.list(dir, [&](const Lister::Entry &entry) {
+	    const auto &path = entry.path;
+	    const auto &buf = entry.buf;
+	    if (buf.st_dev != device) {
+		return;
 	    }
 
-	    if (entry->d_type == DT_DIR) {
+	    own.inodes++;
+	    own.mtime = std::max(own.mtime, buf.st_mtime);
 
-		auto child = f(path, device);
-		result->size += child->size;
+	    if (entry.type == DT_DIR) {
 
-		if (child->size >= GB) {
-		    result->children.push_back(child);
+		auto child = child_of(w, path);
+		if (offer(child)) {
+		    return;
+		}
+		if (reserve_fd()) {
+		    const auto descended = std::chrono::steady_clock::now();
+		    scan(child);
+		    stats->open_fds--;
+		    nested += std::chrono::steady_clock::now() - descended;
+		} else {
+		    deferred.push_back(child);
+		    prefetcher.offer(child);
 		}
 
-	    } else if (entry->d_type == DT_REG) {
+	    } else if (entry.type == DT_REG) {
 
-		result->size += buf.st_blocks * 512; // man 2 stat
+		own.size += buf.st_blocks * 512; // man 2 stat
+		files++;
+
+		if (opts.slack) {
+		    account_slack(buf, own);
+		}
+
+		if (opts.histogram) {
+		    if (!own.histogram) {
+			own.histogram.reset(new Histogram());
+		    }
+		    const int b = Histogram::bucket(buf.st_size);
+		    own.histogram->count[b]++;
+		    own.histogram->bytes[b] += buf.st_blocks * 512;
+		}
+
+		if (opts.compress_min && size_t(buf.st_size) >= opts.compress_min) {
+		    sample_compression(path, buf, opts, stats, own);
+		}
+		if (opts.sparse_min && size_t(buf.st_size) >= opts.sparse_min) {
+		    scan_zero_blocks(path, buf, opts, stats, own);
+		}
+		if (opts.recorder) {
+		    shape.files[Histogram::bucket(buf.st_size)]++;
+		}
+
+	    } else {
+		shape.other++;
 	    }
+	});
+	if (opts.recorder) {
+	    shape.micros = std::chrono::duration_cast<std::chrono::microseconds>(
+			       std::chrono::steady_clock::now() - began - nested)
+			       .count();
+	    opts.recorder->finish(w->shape_id, shape);
 	}
 
-	closedir(dirp);
+	// the descriptor just closed now serves each deferred child
+	for (auto &child : deferred) {
+	    descend(child);
+	}
+
+	stats->directories++;
+	stats->files += files;
+
+	if (opts.chargeback) {
+	    opts.chargeback->charge(w->charge, own);
+	}
+
+	{
+	    std::lock_guard<std::mutex> guard(w->m);
+	    absorb(w->node, own);
+	}
+	complete(w);
     }
 
-    return result;
-}
+    /*
+     * Splits the difference between allocated and apparent size: up to
+     * a block of it is the unused end of the last block, anything more
+     * was allocated ahead of the data.  Sparse files count as neither.
+     */
+    void account_slack(const struct stat &buf, Node &own) const {
+	const size_t allocated = buf.st_blocks * 512;
+	const size_t apparent = buf.st_size;
+	const size_t rounded = (apparent + block - 1) / block * block;
+	if (allocated <= apparent) {
+	    return;
+	}
+	own.slack_tail += std::min(allocated, rounded) - apparent;
+	if (allocated > rounded) {
+	    own.slack_prealloc += allocated - rounded;
+	}
+    }
 
-static NodePtr disk_consumption(std::string dir, const dev_t device) {
-    return traverse_directory(dir, device, disk_consumption);
-}
+    /*
+     * Memory is only accounted under -max-memory.  A directory costs its
+     * Work while it is outstanding and its Node, plus the pointer to it,
+     * once retained; path strings are counted by capacity.
+     */
+    void account(std::atomic<size_t> &memory, const size_t bytes) {
+	if (opts.max_memory) {
+	    memory += bytes;
+	    raise_max(stats->memory_peak,
+		      stats->tree_memory.load() + stats->work_memory.load());
+	}
+    }
 
-static bool remove(std::queue<std::string> *q, std::string &receiver) {
-    static std::mutex m;
-    std::lock_guard<std::mutex> guard(m);
-    if (q->empty()) {
-	return false;
+    static size_t work_cost(const Work &w) {
+	return sizeof(Work) + 16 + w.node.fullpath.capacity();
     }
-    receiver = q->front();
-    q->pop();
-    return true;
-}
 
-static NodePtr worker(std::queue<std::string> *q, const dev_t device) {
-    auto result = std::make_shared<Node>();
-    for (std::string dir; remove(q, dir);) {
-	auto child = disk_consumption(dir, device);
-	result->size += child->size;
-	result->children.push_back(child);
+    static size_t node_cost(const Node &n) {
+	return sizeof(Node) + 16 + sizeof(NodePtr) + n.fullpath.capacity() +
+	       (n.histogram ? sizeof(Histogram) : 0);
+    }
+
+    static int size_class(const size_t size) {
+	return size ? 63 - __builtin_clzll(size) : 0;
+    }
+
+    void hold(const Node &n) {
+	if (opts.max_memory) {
+	    stats->tree_by_size[size_class(n.size)] += node_cost(n);
+	    account(stats->tree_memory, node_cost(n));
+	}
+    }
+
+    // gives back the memory of every retained node beneath, counting them
+    size_t release_beneath(const Node &n) {
+	size_t count = 0;
+	for (auto &child : n.children) {
+	    count += release(*child);
+	}
+	return count;
+    }
+
+    size_t release(const Node &n) {
+	stats->tree_by_size[size_class(n.size)] -= node_cost(n);
+	stats->tree_memory -= node_cost(n);
+	return 1 + release_beneath(n);
     }
-    return result;
-}
 
-static NodePtr top_level(std::string dir, const int threads) {
-    if (dir.size() > 1 && dir.back() == '/') {
-	dir = dir.substr(0, dir.size() - 1);
+    // whether a finished directory is to be folded into its parent
+    bool coarse(const Node &n) const {
+	const size_t floor = stats->retain_floor;
+	return opts.max_memory && floor > opts.retain && n.size < floor;
     }
+
+    /*
+     * Folds retained branches below the current floor into their
+     * parents, everywhere under a finished node.  Each subtree is only
+     * walked again after the floor has risen.
+     */
+    void coarsen(Node &node) {
+	const size_t floor = stats->retain_floor;
+	if (node.pruned_at >= floor) {
+	    return;
+	}
+	node.pruned_at = floor;
+	auto &children = node.children;
+	for (size_t i = 0; i < children.size();) {
+	    auto &child = *children[i];
+	    if (!coarse(child)) {
+		coarsen(child);
+		i++;
+		continue;
+	    }
+	    const size_t folded = release(child);
+	    node.coarsened += folded;
+	    stats->coarsened += folded;
+	    stats->retained -= folded;
+	    children.erase(children.begin() + i);
+	}
+    }
+
+    /*
+     * Over its share, the tree sets the floor to the smallest power of
+     * two that would leave it half full, judged by what it holds now,
+     * so the floor moves once per shortfall however many directories
+     * finish before coarsening catches up.  The top level is folded
+     * too once the floor has risen.
+     */
+    void stay_under_budget() {
+	const size_t share = opts.max_memory / 2;
+	if (stats->tree_memory <= share) {
+	    return;
+	}
+	size_t kept = 0;
+	int c = 63;
+	for (; c > 0; c--) {
+	    kept += stats->tree_by_size[c];
+	    if (kept > share / 2) {
+		break;
+	    }
+	}
+	// just above -size folds the top level, which it does not govern
+	const size_t floor = size_t(1) << std::min(c + 1, 63);
+	raise_max(stats->retain_floor, std::max(floor, opts.retain + 1));
+    }
+
+    void complete(WorkPtr w) {
+	while (w && --w->outstanding == 0) {
+
+	    if (w->depth >= 1 && opts.max_memory && opts.parent_percent) {
+		for (auto &child : w->node.children) {
+		    if (!significant(opts, w->node, *child)) {
+			release(*child);
+		    }
+		}
+	    }
+	    if (w->depth >= 1) {
+		stats->retained -= prune_insignificant(opts, w->node);
+	    }
+	    if (opts.max_memory) {
+		stats->work_memory -= work_cost(*w);
+		coarsen(w->node);
+	    }
+	    if (opts.finished) {
+		opts.finished(w->node);
+	    }
+
+	    auto parent = std::move(w->parent);
+
+	    if (!parent) {
+		result = std::make_shared<Node>(std::move(w->node));
+		stats->retained++;
+		return;
+	    }
+
+	    {
+		std::lock_guard<std::mutex> guard(parent->m);
+		absorb(parent->node, w->node);
+		const bool kept = worth_keeping(opts, w->depth, w->node.size);
+		if (kept && !coarse(w->node)) {
+		    hold(w->node);
+		    parent->node.children.push_back(
+			std::make_shared<Node>(std::move(w->node)));
+		    stats->retained++;
+		    if (opts.max_memory) {
+			stay_under_budget();
+			coarsen(parent->node);
+		    }
+		} else if (kept) {
+		    const size_t folded = 1 + release_beneath(w->node);
+		    stats->retained -= folded - 1;
+		    parent->node.coarsened += folded;
+		    stats->coarsened += folded;
+		} else if (opts.max_memory) {
+		    stats->retained -= release_beneath(w->node);
+		}
+	    }
+
+	    w = std::move(parent);
+	}
+    }
+};
+
+/*
+ * Open directories are bounded by RLIMIT_NOFILE, so lift the soft limit
+ * to the hard one where we may and keep some descriptors in reserve for
+ * stdio and the rest of the process.
+ */
+static size_t directory_fd_budget(const Options &opts) {
+    const size_t reserve = 16 + opts.threads;
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+	return reserve;
+    }
+    if (limit.rlim_cur != limit.rlim_max) {
+	auto raised = limit;
+	raised.rlim_cur = limit.rlim_max;
+	if (raised.rlim_cur == RLIM_INFINITY || raised.rlim_cur > 1 << 20) {
+	    raised.rlim_cur = 1 << 20;
+	}
+	if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+	    limit = raised;
+	}
+    }
+
+    size_t budget = limit.rlim_cur > 2 * reserve ? limit.rlim_cur - reserve
+						 : reserve;
+    if (opts.max_fds && opts.max_fds < budget) {
+	// every worker holds at least the directory it is reading
+	budget = std::max<size_t>(opts.max_fds, opts.threads);
+    }
+    return budget;
+}
+
+NodePtr scan_listed(Lister &lister, const std::string &dir, const dev_t device,
+		    const size_t block, const Options &opts, Stats *stats) {
+    stats->frontier_limit = opts.frontier;
+    stats->fd_limit = directory_fd_budget(opts);
+
+    Scanner scanner(device, block, opts, stats, lister);
+    return scanner.run(dir);
+}
+
+static NodePtr top_level(const std::string &dir, const Options &opts,
+			 Stats *stats) {
     struct stat buf;
     if (stat(dir.c_str(), &buf)) {
 	throw std::runtime_error("cannot stat directory: " + dir);
@@ -124,36 +714,132 @@ static NodePtr top_level(std::string dir, const int threads) {
 	throw std::runtime_error(dir + " is not a directory");
     }
 
-    std::queue<std::string> q;
+    struct statvfs fs;
+    const size_t block = statvfs(dir.c_str(), &fs) ? 4096 : fs.f_frsize;
 
-    auto q_pusher = [&](std::string sub, dev_t) -> NodePtr {
-			q.push(sub);
-			return std::make_shared<Node>();
-		    };
+    FilesystemLister lister;
+    return scan_listed(lister, dir, buf.st_dev, block, opts, stats);
+}
+
+static void print_summary(const Stats &stats, const double elapsed) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    const double rss = usage.ru_maxrss; // bytes
+#else
+    const double rss = usage.ru_maxrss * 1024.0; // kilobytes
+#endif
 
-    const dev_t device = buf.st_dev;
+    ::fprintf(stderr, "directories %zu, files %zu, retained nodes %zu\n",
+	      stats.directories.load(), stats.files.load(),
+	      stats.retained.load());
+    if (stats.fd_limit) {
+	::fprintf(stderr, "frontier peak %zu of %zu queued directories\n",
+		  stats.frontier_peak, stats.frontier_limit);
+	::fprintf(stderr, "open directories peak %zu of %zu\n",
+		  stats.open_fds_peak.load(), stats.fd_limit);
+    }
+    if (stats.prefetched || stats.prefetch_late) {
+	::fprintf(stderr, "prefetched %zu directories, %zu too late\n",
+		  stats.prefetched.load(), stats.prefetch_late.load());
+    }
+    if (stats.sampled_files || stats.sparse_files) {
+	::fprintf(stderr, "read %.1f MB of %zu sampled and %zu sparse files\n",
+		  stats.io_spent.load() / (1024.0 * 1024),
+		  stats.sampled_files.load(), stats.sparse_files.load());
+    }
+    if (stats.memory_peak) {
+	::fprintf(stderr,
+		  "accounted memory peak %.1f MB, %zu directories coarsened\n",
+		  stats.memory_peak / (1024.0 * 1024), stats.coarsened.load());
+    }
+    ::fprintf(stderr, "peak resident memory %.1f MB\n", rss / (1024 * 1024));
+    ::fprintf(stderr, "elapsed %.2f s\n", elapsed);
+}
 
-    auto result = traverse_directory(dir, device, q_pusher);
+static std::string power_of_two(const int exponent) {
+    static const char units[] = "BKMGTPE";
+    return std::to_string(1ull << exponent % 10) + units[exponent / 10];
+}
 
-    std::vector<std::future<NodePtr>> futures;
+static void print_histogram(const Histogram &h) {
+    for (int b = 0; b < 65; b++) {
+	if (!h.count[b]) {
+	    continue;
+	}
+	const auto range = b ? power_of_two(b - 1) + "-" +
+				   (b < 64 ? power_of_two(b) : "")
+			     : "empty";
+	::printf("  %-9s %10zu files %8.1f GB\n", range.c_str(), h.count[b],
+		 1.0 * h.bytes[b] / GB);
+    }
+}
 
-    for (int i = 0; i < threads; i++) {
-	futures.emplace_back(std::async(std::launch::async, worker, &q, device));
+/*
+ * Indented lines under a reported directory for the optional analyses.
+ */
+static void annotate(const Node &node, const Options &opts) {
+    if (node.histogram) {
+	print_histogram(*node.histogram);
+    }
+    if (opts.compress_min && node.compress_sampled) {
+	::printf("  compression would save ~%.1f GB of %.1f GB sampled (%.0f%%)\n",
+		 1.0 * node.compress_saving / GB,
+		 1.0 * node.compress_sampled / GB,
+		 100.0 * node.compress_saving / node.compress_sampled);
+    }
+    if (opts.slack && node.slack_tail + node.slack_prealloc) {
+	::printf("  slack %.1f GB in block tails, %.1f GB preallocated\n",
+		 1.0 * node.slack_tail / GB, 1.0 * node.slack_prealloc / GB);
+    }
+    if (opts.sparse_min && node.sparse_examined) {
+	::printf("  sparse would reclaim %.1f GB of %.1f GB examined\n",
+		 1.0 * node.sparse_zero / GB, 1.0 * node.sparse_examined / GB);
+    }
+    if (node.coarsened) {
+	::printf("  coarsened: %zu smaller directories folded in by -max-memory\n",
+		 node.coarsened);
     }
+}
+
+static size_t slack(const Node &node) {
+    return node.slack_tail + node.slack_prealloc;
+}
 
-    for (auto &f : futures) {
-	auto job = f.get();
-	for (auto child : job->children) {
-	    result->size += child->size;
-	    result->children.push_back(child);
+/*
+ * Directories wasting the most space themselves, that is not counting
+ * what their retained subdirectories waste.
+ */
+static void print_worst_slack(const NodePtr &root, const size_t count) {
+    std::vector<std::pair<size_t, const Node *>> own;
+    std::vector<const Node *> pending{root.get()};
+    while (!pending.empty()) {
+	auto node = pending.back();
+	pending.pop_back();
+	size_t waste = slack(*node);
+	for (auto &child : node->children) {
+	    waste -= slack(*child);
+	    pending.push_back(child.get());
 	}
+	own.emplace_back(waste, node);
     }
 
-    return result;
+    const size_t shown = std::min(count, own.size());
+    std::partial_sort(own.begin(), own.begin() + shown, own.end(),
+		      [](const std::pair<size_t, const Node *> &a,
+			 const std::pair<size_t, const Node *> &b) {
+			  return a.first > b.first;
+		      });
+
+    ::printf("\nworst slack, not counting retained subdirectories\n");
+    for (size_t i = 0; i < shown && own[i].first; i++) {
+	auto node = own[i].second;
+	::printf("%s %.1f\n", node->fullpath.c_str(), 1.0 * own[i].first / GB);
+    }
 }
 
 static void display_results(NodePtr node, const size_t reportable_size,
-                            const bool elision) {
+			    const bool elision, const Options &opts) {
     std::sort(node->children.begin(), node->children.end(),
 	      [](const NodePtr &a, const NodePtr &b) -> bool {
 		  return a->size > b->size;
@@ -163,38 +849,401 @@ static void display_results(NodePtr node, const size_t reportable_size,
 
 	auto gigs = 1.0 * node->size / GB;
 	::printf("%s %.1f\n", node->fullpath.c_str(), gigs);
+	annotate(*node, opts);
 
 	if (elision && node->children.size() == 1) {
 	    while (node->children.size() == 1) {
 		node = node->children.at(0);
 	    }
-	    display_results(node, reportable_size, elision);
+	    display_results(node, reportable_size, elision, opts);
 
 	} else {
 	    for (auto child : node->children) {
-		display_results(child, reportable_size, elision);
+		if (significant(opts, *node, *child)) {
+		    display_results(child, reportable_size, elision, opts);
+		}
 	    }
 	}
     }
 }
 
-int main(int argc, char **argv) {
+// blocks this process had to read from storage so far
+static long blocks_read() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_inblock;
+}
+
+/*
+ * How this run's scan went, as a "#scan" header value.  Whether the
+ * metadata was cached is judged by the blocks read from storage per
+ * entry: none when warm, more than one in ten entries when cold.
+ */
+static std::string scan_metrics(const NodePtr &root, const Options &opts,
+				const double seconds, const long blocks) {
+    const size_t entries = root->inodes + 1;
+    const char *cache = blocks * 10 > long(entries)    ? "cold"
+			: blocks * 100 > long(entries) ? "partial"
+						       : "warm";
+
+    char metrics[256];
+    snprintf(metrics, sizeof metrics,
+	     "time=%ld seconds=%.2f entries=%zu rate=%.0f threads=%d "
+	     "backend=%s cache=%s",
+	     long(time(0)), seconds, entries, entries / std::max(seconds, 1e-6),
+	     opts.threads, opts.image.empty() ? "readdir" : "ext4image", cache);
+    return metrics;
+}
+
+static std::string metric(const std::string &metrics, const std::string &key) {
+    const auto at = (" " + metrics).find(" " + key + "=");
+    if (at == std::string::npos) {
+	return "";
+    }
+    const auto start = at + key.size() + 1;
+    return metrics.substr(start, metrics.find(' ', start) - start);
+}
+
+/*
+ * The "#scan" lines of earlier snapshots of the same root, each scan
+ * once and the most recent last, or none if there is no such snapshot.
+ */
+static std::vector<std::string>
+scan_history(const std::vector<std::string> &files, const std::string &dir) {
+    static const size_t KEPT = 19;
+    std::vector<std::string> history;
+    for (auto &file : files) {
+	struct stat buf;
+	if (file.empty() || stat(file.c_str(), &buf)) {
+	    continue;
+	}
+	try {
+	    Snapshot s(file);
+	    const auto root = s.header("root");
+	    if (unescape_path(root.data(), root.size()) != dir) {
+		continue;
+	    }
+	    for (auto &h : s.header_lines()) {
+		if (h.first == "scan") {
+		    history.push_back(h.second);
+		}
+	    }
+	} catch (const std::runtime_error &) {
+	    continue;
+	}
+    }
+    std::sort(history.begin(), history.end(),
+	      [](const std::string &a, const std::string &b) {
+		  const long x = std::atol(metric(a, "time").c_str());
+		  const long y = std::atol(metric(b, "time").c_str());
+		  return x < y || (x == y && a < b);
+	      });
+    history.erase(std::unique(history.begin(), history.end()), history.end());
+    if (history.size() > KEPT) {
+	history.erase(history.begin(), history.end() - KEPT);
+    }
+    return history;
+}
+
+/*
+ * Warns when this scan ran well below the median rate of at least three
+ * earlier scans of the same root under the same conditions.
+ */
+static void check_throughput(const std::vector<std::string> &history,
+			     const std::string &current) {
+    std::vector<double> rates;
+    for (auto &h : history) {
+	if (metric(h, "backend") == metric(current, "backend") &&
+	    metric(h, "threads") == metric(current, "threads") &&
+	    metric(h, "cache") == metric(current, "cache") &&
+	    !metric(h, "rate").empty()) {
+	    rates.push_back(std::stod(metric(h, "rate")));
+	}
+    }
+    if (rates.size() < 3) {
+	return;
+    }
+    std::sort(rates.begin(), rates.end());
+    const double median = rates[rates.size() / 2];
+    const double rate = std::stod(metric(current, "rate"));
+    if (rate < median * 2 / 3) {
+	::fprintf(stderr,
+		  "warning: %.0f entries/s is %.0f%% below the median of %zu "
+		  "earlier %s scans, %.0f entries/s\n",
+		  rate, 100 * (1 - rate / median), rates.size(),
+		  metric(current, "cache").c_str(), median);
+    }
+}
+
+/*
+ * Header of a snapshot of this run.  The device is that of the scanned
+ * directory, or the image file for -image.  Scans are the "#scan"
+ * lines, oldest first.
+ */
+static std::vector<std::pair<std::string, std::string>>
+snapshot_header(const std::string &dir, const Options &opts,
+		const std::vector<std::string> &scans) {
+    struct stat buf;
+    const auto &source = opts.image.empty() ? dir : opts.image;
+    const auto device = stat(source.c_str(), &buf) ? 0 : buf.st_dev;
+
+    char host[256] = "";
+    gethostname(host, sizeof host - 1);
+
+    std::vector<std::pair<std::string, std::string>> header{
+	{"root", escape_path(dir)},
+	{"device", std::to_string(device)},
+	{"time", std::to_string(time(0))},
+	{"host", host},
+	{"retain", std::to_string(opts.retain)},
+	{"max-depth", std::to_string(opts.max_depth)}};
+    for (auto &s : scans) {
+	header.emplace_back("scan", s);
+    }
+    return header;
+}
+
+/*
+ * bdb merge [-threads N] [-top N] SNAPSHOT...
+ */
+static int merge_main(int argc, char **argv) {
+    int threads = 4;
+    size_t top = 3;
+
+    while (argc > 2 && argv[1][0] == '-') {
+
+	std::string option(argv[1]);
+
+	if (option == "-threads") {
+	    threads = std::stoi(argv[2]);
+
+	} else if (option == "-top") {
+	    top = std::stoul(argv[2]);
+
+	} else {
+	    throw std::runtime_error("unknown option: " + option);
+	}
+
+	argv += 2;
+	argc -= 2;
+    }
+
+    merge_snapshots(std::vector<std::string>(argv + 1, argv + argc), threads,
+		    std::max<size_t>(top, 1));
+    return 0;
+}
+
+/*
+ * bdb search [-threads N] PATTERN COLUMNAR...
+ */
+static int search_main(int argc, char **argv) {
     int threads = 4;
-    size_t reportable_size = 1 * GB;
+
+    while (argc > 2 && std::string(argv[1]) == "-threads") {
+	threads = std::max(std::stoi(argv[2]), 1);
+	argv += 2;
+	argc -= 2;
+    }
+    if (argc < 3) {
+	throw std::runtime_error("search needs a pattern and columnar files");
+    }
+
+    search_columnar(argv[1], std::vector<std::string>(argv + 2, argv + argc),
+		    threads);
+    return 0;
+}
+
+static int replay_main(int argc, char **argv) {
+    Options opts;
+
+    while (argc > 1 && argv[1][0] == '-') {
+	const std::string option(argv[1]);
+	if (option == "-summary") {
+	    opts.summary = true;
+	    argv++;
+	    argc--;
+	    continue;
+	}
+	if (argc < 3) {
+	    break;
+	}
+	if (option == "-threads") {
+	    opts.threads = std::max(std::stoi(argv[2]), 1);
+	} else if (option == "-frontier") {
+	    opts.frontier = std::stoul(argv[2]);
+	} else if (option == "-max-fds") {
+	    opts.max_fds = std::stoul(argv[2]);
+	} else if (option == "-prefetch") {
+	    opts.prefetch = std::stoul(argv[2]);
+	} else {
+	    throw std::runtime_error("unknown replay option: " + option);
+	}
+	argv += 2;
+	argc -= 2;
+    }
+    if (argc != 2) {
+	throw std::runtime_error("replay needs a shape file");
+    }
+
+    Stats stats;
+    const auto start = std::chrono::steady_clock::now();
+    replay_shape(argv[1], opts, &stats);
+    if (opts.summary) {
+	std::chrono::duration<double> elapsed =
+	    std::chrono::steady_clock::now() - start;
+	print_summary(stats, elapsed.count());
+    }
+    return 0;
+}
+
+/*
+ * One or more comma separated sizes in GB, fractions allowed, or with a
+ * trailing '%' in percent of the space used on the filesystem.
+ */
+static std::vector<Threshold> parse_sizes(const std::string &text) {
+    std::vector<Threshold> sizes;
+    for (size_t start = 0; start <= text.size();) {
+	auto end = text.find(',', start);
+	if (end == std::string::npos) {
+	    end = text.size();
+	}
+	sizes.push_back(parse_threshold(text.substr(start, end - start)));
+	start = end + 1;
+    }
+    return sizes;
+}
+
+/*
+ * Bytes in use on the filesystem holding dir, which statvfs knows
+ * before the scan starts.
+ */
+static size_t used_space(const std::string &dir, const Options &opts) {
+    struct statvfs fs;
+    if (!opts.image.empty() || statvfs(dir.c_str(), &fs)) {
+	throw std::runtime_error("no used space known for a percentage size");
+    }
+    return size_t(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    std::vector<Threshold> sizes{parse_threshold("1")};
 
     try {
 
+	if (argc > 1 && std::string(argv[1]) == "merge") {
+	    return merge_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "search") {
+	    return search_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "replay") {
+	    return replay_main(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "materialize") {
+	    if (argc != 4) {
+		throw std::runtime_error("materialize needs a shape file and "
+					 "a directory");
+	    }
+	    materialize_shape(argv[2], argv[3]);
+	    return 0;
+	}
+
 	bool elided = true;
+	std::string snapshot_file;
+	std::string update_file;
+	int watch_interval = 0;
+	std::string cache_dir;
+	long max_age = -1;
+	std::string columnar_file;
+	std::unique_ptr<Chargeback> chargeback;
+	std::string record_file;
+	ShapeRecorder recorder;
+	std::string compare_file;
+	Threshold growth;
+	std::string growth_limit;
+	double explain = 0;
 
 	while (argc > 2 && argv[1][0] == '-') {
 
 	    std::string option(argv[1]);
 
 	    if (option == "-threads") {
-		threads = std::stoi(argv[2]);
+		opts.threads = std::max(std::stoi(argv[2]), 1);
 
 	    } else if (option == "-size") {
-		reportable_size = std::stoi(argv[2]) * GB;
+		sizes = parse_sizes(argv[2]);
+
+	    } else if (option == "-parent-percent") {
+		opts.parent_percent = std::stod(argv[2]);
+
+	    } else if (option == "-max-depth") {
+		opts.max_depth = std::stoi(argv[2]);
+
+	    } else if (option == "-frontier") {
+		opts.frontier = std::stoul(argv[2]);
+
+	    } else if (option == "-max-fds") {
+		opts.max_fds = std::stoul(argv[2]);
+
+	    } else if (option == "-max-memory") {
+		opts.max_memory = std::stoul(argv[2]) * 1024 * 1024;
+
+	    } else if (option == "-prefetch") {
+		opts.prefetch = std::stoul(argv[2]);
+
+	    } else if (option == "-image") {
+		opts.image = argv[2];
+
+	    } else if (option == "-compress") {
+		opts.compress_min = std::stod(argv[2]) * 1024 * 1024;
+
+	    } else if (option == "-sparse") {
+		opts.sparse_min = std::stod(argv[2]) * 1024 * 1024;
+
+	    } else if (option == "-io-budget") {
+		opts.io_budget = std::stod(argv[2]) * 1024 * 1024;
+
+	    } else if (option == "-snapshot") {
+		snapshot_file = argv[2];
+
+	    } else if (option == "-update") {
+		update_file = argv[2];
+
+	    } else if (option == "-cache") {
+		cache_dir = argv[2];
+
+	    } else if (option == "-max-age") {
+		max_age = std::stol(argv[2]);
+
+	    } else if (option == "-watch") {
+		watch_interval = std::stoi(argv[2]);
+
+	    } else if (option == "-chargeback") {
+		chargeback.reset(new Chargeback(argv[2]));
+		opts.chargeback = chargeback.get();
+
+	    } else if (option == "-record") {
+		record_file = argv[2];
+		opts.recorder = &recorder;
+
+	    } else if (option == "-columnar") {
+		columnar_file = argv[2];
+
+	    } else if (option == "-compare") {
+		compare_file = argv[2];
+
+	    } else if (option == "-growth") {
+		growth = parse_threshold(argv[2]);
+
+	    } else if (option == "-growth-limit") {
+		growth_limit = argv[2];
+
+	    } else if (option == "-explain") {
+		explain = std::stod(argv[2]);
+		if (explain <= 0 || explain > 100) {
+		    throw std::runtime_error("-explain takes a percentage");
+		}
 
 	    } else if (option == "-no-elision") {
 		elided = false;
@@ -202,6 +1251,30 @@ int main(int argc, char **argv) {
 		argv++;
 		continue;
 
+	    } else if (option == "-summary") {
+		opts.summary = true;
+		argc--;
+		argv++;
+		continue;
+
+	    } else if (option == "-reconcile") {
+		opts.reconcile = true;
+		argc--;
+		argv++;
+		continue;
+
+	    } else if (option == "-histogram") {
+		opts.histogram = true;
+		argc--;
+		argv++;
+		continue;
+
+	    } else if (option == "-slack") {
+		opts.slack = true;
+		argc--;
+		argv++;
+		continue;
+
 	    } else {
 		throw std::runtime_error("unknown option: " + option);
 	    }
@@ -210,7 +1283,177 @@ int main(int argc, char **argv) {
 	    argc -= 2;
 	}
 
-	display_results(top_level(argv[1], threads), reportable_size, elided);
+	if (explain) {
+	    if (argc != 3) {
+		throw std::runtime_error("-explain needs OLD and NEW snapshots");
+	    }
+	    explain_growth(Snapshot(argv[1]), Snapshot(argv[2]), explain);
+	    return 0;
+	}
+
+	std::string dir = argv[1];
+	if (dir.size() > 1 && dir.back() == '/') {
+	    dir = dir.substr(0, dir.size() - 1);
+	}
+
+	std::vector<size_t> reportable_sizes;
+	for (auto &t : sizes) {
+	    reportable_sizes.push_back(
+		t.percent ? t.value / 100 * used_space(dir, opts) : t.value * GB);
+	    opts.retain = std::min(opts.retain, reportable_sizes.back());
+	}
+
+	// an updated snapshot keeps what the run that wrote it kept
+	std::unique_ptr<Snapshot> updating;
+	if (!update_file.empty()) {
+	    updating.reset(new Snapshot(update_file));
+	    opts.retain = snapshot_retain(*updating);
+	    check_update(*updating, dir);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	Stats stats;
+
+	std::unique_ptr<Snapshot> previous;
+	std::unique_ptr<GrowthReport> growth_report;
+	if (!compare_file.empty()) {
+	    previous.reset(new Snapshot(compare_file));
+	    growth_report.reset(new GrowthReport(*previous, growth));
+	    if (!growth_limit.empty()) {
+		growth_report->set_limit(parse_threshold(growth_limit));
+	    }
+	    auto report = growth_report.get();
+	    opts.finished = [report](const Node &node) {
+		report->finished(node);
+	    };
+	} else if (!growth_limit.empty()) {
+	    throw std::runtime_error("-growth-limit needs -compare");
+	}
+	if (watch_interval && (growth_report || !opts.image.empty())) {
+	    throw std::runtime_error("-watch needs a report of a mounted tree");
+	}
+
+	if (!opts.image.empty() && (opts.reconcile || opts.compress_min ||
+				  opts.sparse_min || opts.histogram ||
+				  opts.slack || opts.chargeback ||
+				  opts.recorder || opts.max_memory)) {
+	    throw std::runtime_error("-image supports none of -reconcile, "
+				     "-compress, -sparse, -histogram, -slack, "
+				     "-chargeback, -record and -max-memory");
+	}
+	if (updating && opts.max_memory) {
+	    throw std::runtime_error("-update cannot be combined with -max-memory");
+	}
+	// a shared result has sizes only and may not be pruned further
+	std::unique_ptr<ResultCache> cache;
+	NodePtr root;
+	const bool shareable = !updating && !opts.parent_percent;
+	if (!cache_dir.empty() && shareable) {
+	    cache.reset(new ResultCache(cache_dir, dir, opts));
+	    if (max_age >= 0 && !growth_report && !opts.histogram &&
+		!opts.slack && !opts.compress_min && !opts.sparse_min &&
+		!opts.chargeback && !opts.recorder && columnar_file.empty()) {
+		root = cache->fresh(max_age, opts);
+	    } else {
+		cache->claim();
+	    }
+	} else if (max_age >= 0 && cache_dir.empty()) {
+	    throw std::runtime_error("-max-age needs -cache");
+	}
+
+	std::future<Reconciliation> reconciliation;
+	if (opts.reconcile) {
+	    reconciliation = std::async(std::launch::async, reconcile_filesystem,
+					dir);
+	}
+
+	// earlier scans of this root, from the snapshot about to be
+	// replaced, the one compared against or the shared result
+	auto scans = scan_history(
+	    {snapshot_file, compare_file, cache ? cache->path() : ""}, dir);
+
+	const bool cached = root != nullptr;
+	if (!cached) {
+	    const long blocks = blocks_read();
+	    const auto began = std::chrono::steady_clock::now();
+	    root = opts.image.empty()
+		       ? top_level(dir, opts, &stats)
+		       : scan_ext4_image(opts.image, dir, opts, &stats);
+	    std::chrono::duration<double> seconds =
+		std::chrono::steady_clock::now() - began;
+	    if (stats.retain_floor > opts.retain) {
+		::fprintf(stderr, "retention raised to %.3g MB to stay under "
+				  "-max-memory\n",
+			  stats.retain_floor / (1024.0 * 1024));
+		opts.retain = stats.retain_floor; // so snapshots say so
+	    }
+
+	    const auto current =
+		scan_metrics(root, opts, seconds.count(), blocks_read() - blocks);
+	    check_throughput(scans, current);
+	    scans.push_back(current);
+	    if (cache) {
+		cache->publish(root, snapshot_header(dir, opts, scans));
+	    }
+	}
+
+	if (!growth_report) {
+	    for (size_t i = 0; i < sizes.size(); i++) {
+		const double gigs = 1.0 * reportable_sizes[i] / GB;
+		if (sizes.size() > 1 && sizes[i].percent) {
+		    ::printf("%s# size > %g%% of used, %.1f GB\n", i ? "\n" : "",
+			     sizes[i].value, gigs);
+		} else if (sizes.size() > 1) {
+		    ::printf("%s# size > %g GB\n", i ? "\n" : "", gigs);
+		}
+		display_results(root, reportable_sizes[i], elided, opts);
+	    }
+	}
+
+	if (updating) {
+	    update_snapshot(update_file, *updating, root,
+			    {"updated", std::to_string(time(0)) + " " +
+					    escape_path(dir)});
+	}
+	if (!snapshot_file.empty()) {
+	    write_snapshot(snapshot_file, root, snapshot_header(dir, opts, scans));
+	}
+	if (!columnar_file.empty()) {
+	    write_columnar(columnar_file, root);
+	}
+	if (opts.recorder) {
+	    recorder.write(record_file);
+	}
+
+	if (opts.reconcile) {
+	    print_reconciliation(reconciliation.get(), root->size);
+	}
+	if (opts.slack) {
+	    print_worst_slack(root, 10);
+	}
+	if (chargeback) {
+	    chargeback->print();
+	}
+
+	if (opts.summary && cached) {
+	    ::fprintf(stderr, "shared result of a scan %ld s ago\n", cache->age);
+	} else if (opts.summary) {
+	    std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	    print_summary(stats, elapsed.count());
+	}
+
+	if (watch_interval) {
+	    ::fflush(stdout);
+	    watch_tree(root, reportable_sizes[0], watch_interval, [&]() {
+		display_results(root, reportable_sizes[0], elided, opts);
+	    });
+	}
+
+	if (growth_report && growth_report->limit_exceeded()) {
+	    ::fprintf(stderr, "growth limit exceeded\n");
+	    return 2;
+	}
 	return 0;
 
     } catch (std::exception &e) {
@@ -0,0 +1,409 @@
+#ifndef BDB_H
+#define BDB_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <sys/stat.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const size_t GB = 1024 * 1024 * 1024;
+
+/*
+ * Files by log2 of their size: bucket 0 holds empty files and bucket b
+ * those of at least 2^(b-1) and less than 2^b bytes.  Bytes are the
+ * allocated ones, so that the buckets add up to the directory total.
+ */
+struct Histogram {
+    size_t count[65];
+    size_t bytes[65];
+
+    static int bucket(const size_t size) {
+	return size ? 64 - __builtin_clzll(size) : 0;
+    }
+};
+
+struct Node;
+using NodePtr = std::shared_ptr<Node>;
+
+struct Node {
+    std::string fullpath;
+    size_t size;
+    size_t inodes; // entries beneath, of any type
+    time_t mtime;  // newest modification time beneath
+    size_t compress_sampled; // bytes of files whose contents were sampled
+    size_t compress_saving;  // estimated saving from compressing them
+    size_t sparse_examined;  // bytes of file data checked for zeros
+    size_t sparse_zero;      // whole zero blocks among them
+    size_t slack_tail;       // allocated past the end in the last block
+    size_t slack_prealloc;   // allocated beyond the last block
+    std::unique_ptr<Histogram> histogram; // with -histogram only
+    size_t coarsened; // directories -max-memory folded in here, not summed
+    size_t pruned_at; // retention floor children were last coarsened to
+    std::vector<NodePtr> children;
+};
+
+// Adds the totals of a finished subdirectory, or of loose entries.
+inline void absorb(Node &into, const Node &from) {
+    into.size += from.size;
+    into.inodes += from.inodes;
+    into.mtime = std::max(into.mtime, from.mtime);
+    into.compress_sampled += from.compress_sampled;
+    into.compress_saving += from.compress_saving;
+    into.sparse_examined += from.sparse_examined;
+    into.sparse_zero += from.sparse_zero;
+    into.slack_tail += from.slack_tail;
+    into.slack_prealloc += from.slack_prealloc;
+    if (from.histogram) {
+	if (!into.histogram) {
+	    into.histogram.reset(new Histogram());
+	}
+	for (int b = 0; b < 65; b++) {
+	    into.histogram->count[b] += from.histogram->count[b];
+	    into.histogram->bytes[b] += from.histogram->bytes[b];
+	}
+    }
+}
+
+/*
+ * How the scanner reads a directory: from the filesystem, or from a
+ * recorded shape for replay.
+ */
+class Lister {
+  public:
+    struct Entry {
+	std::string path;
+	unsigned char type; // DT_DIR, DT_REG or another d_type
+	struct stat buf;    // as lstat fills it
+    };
+    virtual ~Lister() {}
+
+    // calls each for every entry, with the directory held open meanwhile
+    virtual void list(const std::string &dir,
+		      const std::function<void(const Entry &)> &each) = 0;
+    // reads ahead a directory that will be listed later
+    virtual void warm(const std::string &dir) = 0;
+};
+
+class Chargeback;
+class ShapeRecorder;
+
+struct Options {
+    int threads = 4;
+    size_t frontier = 4096; // queued directories awaiting a worker
+    size_t max_fds = 0;     // open directory budget, 0 for RLIMIT_NOFILE
+    size_t prefetch = 0;    // lookahead window of directories to warm
+    size_t retain = GB;     // smallest branch kept below the top level
+    double parent_percent = 0; // least share of its parent worth keeping
+    int max_depth = 0;      // deepest level kept in the tree, 0 for all
+    std::string image;      // ext2/3/4 image to read instead of the tree
+    size_t compress_min = 0; // sample files this large for compression
+    size_t sparse_min = 0;   // look for zero blocks in files this large
+    size_t io_budget = GB;   // bytes of file contents we may read
+    bool summary = false;
+    bool reconcile = false;
+    bool histogram = false;
+    bool slack = false;
+    Chargeback *chargeback = nullptr; // cost centers to charge, if any
+    ShapeRecorder *recorder = nullptr; // shape of the tree, for -record
+    size_t max_memory = 0; // bytes for the tree and queued work, 0 for any
+
+    // called as each directory's total becomes final, from any thread
+    std::function<void(const Node &)> finished;
+};
+
+struct Stats {
+    std::atomic<size_t> directories{0};
+    std::atomic<size_t> files{0};
+    std::atomic<size_t> retained{0};
+    std::atomic<size_t> open_fds{0};
+    std::atomic<size_t> open_fds_peak{0};
+    std::atomic<size_t> prefetched{0};
+    std::atomic<size_t> prefetch_late{0};
+    std::atomic<size_t> io_spent{0};
+    std::atomic<size_t> sampled_files{0};
+    std::atomic<size_t> sparse_files{0};
+    std::atomic<size_t> tree_memory{0};  // retained nodes, with -max-memory
+    std::atomic<size_t> tree_by_size[64] = {}; // by log2 of the node's size
+    std::atomic<size_t> work_memory{0};  // directories yet to finish
+    std::atomic<size_t> memory_peak{0};
+    std::atomic<size_t> retain_floor{0}; // raised to stay under -max-memory
+    std::atomic<size_t> coarsened{0};
+    size_t frontier_peak = 0;
+    size_t frontier_limit = 0;
+    size_t fd_limit = 0;
+};
+
+/*
+ * Whether a finished directory stays in the tree.  The top level is
+ * always kept; below that only branches of at least opts.retain, a
+ * gigabyte unless a smaller report threshold needs more, and none
+ * deeper than -max-depth.  Their bytes count in their parents either way.
+ */
+inline bool worth_keeping(const Options &opts, const int depth,
+			  const size_t size) {
+    if (opts.max_depth && depth > opts.max_depth) {
+	return false;
+    }
+    return depth == 1 || size >= opts.retain;
+}
+
+/*
+ * Whether a child makes up at least -parent-percent of its parent.
+ */
+inline bool significant(const Options &opts, const Node &parent,
+			const Node &child) {
+    return child.size * 100.0 >= opts.parent_percent * parent.size;
+}
+
+/*
+ * Once a directory's total is final, drops the retained children too
+ * small a share of it, returning how many went.  The top level is
+ * always kept, so this applies from depth 1 down.
+ */
+inline size_t prune_insignificant(const Options &opts, Node &node) {
+    if (!opts.parent_percent) {
+	return 0;
+    }
+    auto &children = node.children;
+    const auto before = children.size();
+    children.erase(std::remove_if(children.begin(), children.end(),
+				  [&](const std::shared_ptr<Node> &child) {
+				      return !significant(opts, node, *child);
+				  }),
+		   children.end());
+    return before - children.size();
+}
+
+// bdb.cpp
+// the retained tree of dir, scanned with directories read through lister
+NodePtr scan_listed(Lister &lister, const std::string &dir, dev_t device,
+		    size_t block, const Options &opts, Stats *stats);
+
+struct HeldOpen {
+    long pid;
+    std::string command;
+    size_t files = 0;
+    size_t bytes = 0;
+};
+
+struct Reconciliation {
+    size_t used = 0;        // statvfs used blocks in bytes
+    size_t held = 0;        // deleted files still open, each counted once
+    size_t unreadable = 0;  // processes whose fds we may not list
+    bool mount_point = true;
+    std::vector<HeldOpen> holders;
+};
+
+// reconcile.cpp
+Reconciliation reconcile_filesystem(const std::string &dir);
+void print_reconciliation(const Reconciliation &r, size_t scanned);
+
+// content.cpp
+void sample_compression(const std::string &path, const struct stat &buf,
+			const Options &opts, Stats *stats, Node &own);
+void scan_zero_blocks(const std::string &path, const struct stat &buf,
+		      const Options &opts, Stats *stats, Node &own);
+
+// cache.cpp
+
+/*
+ * Snapshots of completed runs shared through a directory, keyed by
+ * device and scanned path.
+ */
+class ResultCache {
+  public:
+    ResultCache(const std::string &dir, const std::string &root,
+		const Options &opts);
+    ~ResultCache();
+    ResultCache(const ResultCache &) = delete;
+    ResultCache &operator=(const ResultCache &) = delete;
+
+    // a published tree at most max_age seconds old, waiting for a run
+    // in progress, or null with the lock held for our own scan
+    NodePtr fresh(long max_age, const Options &opts);
+    void claim(); // take the lock if free, to scan without consulting
+    void publish(const NodePtr &tree,
+		 const std::vector<std::pair<std::string, std::string>> &header);
+    long age = 0; // of the tree fresh() returned, in seconds
+    const std::string &path() const { return file; }
+
+  private:
+    std::string root;
+    std::string device;
+    std::string file;
+    int lock_fd;
+
+    NodePtr load(long max_age, const Options &opts);
+};
+
+// chargeback.cpp
+
+/*
+ * Cost centers owning path prefixes, compiled into a trie of path
+ * components that each directory steps through once, from its parent's
+ * positions, as the scan reaches it.
+ */
+class Chargeback {
+  public:
+    struct Match {
+	std::vector<uint32_t> rules; // trie positions, empty once off the trie
+	int center = -1;             // -1 while no rule has matched
+    };
+
+    explicit Chargeback(const std::string &rules);
+
+    Match start(const std::string &root) const;
+    Match descend(const Match &parent, const std::string &name) const;
+    void charge(const Match &m, const Node &own);
+    void print() const;
+
+  private:
+    struct Rule {
+	std::unordered_map<std::string, uint32_t> literal;
+	std::vector<std::pair<std::string, uint32_t>> globs;
+	int center = -1;
+    };
+    std::vector<Rule> trie{Rule()};
+    std::vector<std::string> centers;
+    std::unique_ptr<std::atomic<size_t>[]> bytes;  // per center, then none
+    std::unique_ptr<std::atomic<size_t>[]> inodes;
+};
+
+// columnar.cpp
+void write_columnar(const std::string &file, const NodePtr &root);
+void search_columnar(const std::string &pattern,
+		     const std::vector<std::string> &files, int threads);
+
+// ext4image.cpp
+NodePtr scan_ext4_image(const std::string &image, const std::string &root,
+			const Options &opts, Stats *stats);
+
+// shape.cpp
+
+/*
+ * Collects the anonymized shape of a scan, one directory at a time from
+ * any thread.
+ */
+class ShapeRecorder {
+  public:
+    static const size_t NONE = size_t(-1);
+
+    struct Directory {
+	size_t parent = NONE;
+	size_t micros = 0;     // listing and statting its own entries
+	size_t other = 0;      // entries neither directory nor regular file
+	unsigned files[65] = {0}; // regular files by Histogram::bucket
+    };
+
+    size_t add(size_t parent); // a directory found, numbered in order
+    void finish(size_t id, Directory d);
+    void write(const std::string &file) const;
+    static std::vector<Directory> read(const std::string &file);
+
+  private:
+    std::mutex m;
+    std::vector<Directory> directories;
+};
+
+void replay_shape(const std::string &file, const Options &opts, Stats *stats);
+void materialize_shape(const std::string &file, const std::string &dir);
+
+// snapshot.cpp
+bool path_before(const char *a, size_t alen, const char *b, size_t blen);
+std::string escape_path(const std::string &path);
+std::string unescape_path(const char *p, size_t len);
+
+class Snapshot {
+  public:
+    struct Record {
+	const char *path; // escaped, inside the mapping
+	size_t length;
+	size_t bytes;
+    };
+
+    explicit Snapshot(const std::string &file);
+    ~Snapshot();
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    const std::vector<Record> &records() const { return rows; }
+    std::string header(const std::string &key) const;
+    const std::vector<std::pair<std::string, std::string>> &
+    header_lines() const {
+	return headers;
+    }
+    const Record *find(const std::string &path) const;
+
+  private:
+    std::string file;
+    const char *data = 0;
+    size_t length = 0;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::vector<Record> rows;
+};
+
+void write_snapshot(const std::string &file, const NodePtr &root,
+		    const std::vector<std::pair<std::string, std::string>> &header);
+size_t snapshot_retain(const Snapshot &snapshot);
+NodePtr snapshot_tree(const Snapshot &snapshot);
+void check_update(const Snapshot &old, const std::string &dir);
+void update_snapshot(const std::string &file, const Snapshot &old,
+		     const NodePtr &subtree,
+		     const std::pair<std::string, std::string> &note);
+
+// A size in GB, or with a trailing '%' a percentage.
+struct Threshold {
+    double value = 0;
+    bool percent = false;
+};
+
+Threshold parse_threshold(const std::string &text);
+
+// merge.cpp
+void merge_snapshots(const std::vector<std::string> &files, int threads,
+		     size_t top);
+
+// explain.cpp
+void explain_growth(const Snapshot &older, const Snapshot &newer,
+		    double percent);
+
+/*
+ * Compares each finished directory with its total in an earlier
+ * snapshot, printing those that grew by at least the report threshold
+ * and noting whether any grew past the limit.
+ */
+class GrowthReport {
+  public:
+    GrowthReport(const Snapshot &previous, const Threshold &report);
+
+    void set_limit(const Threshold &t) {
+	limit = t;
+	have_limit = true;
+    }
+    void finished(const Node &node);
+    bool limit_exceeded() const { return exceeded; }
+
+  private:
+    const Snapshot &previous;
+    Threshold report;
+    Threshold limit;
+    size_t retained; // smallest branch the old run recorded
+    std::string root;
+    int max_depth;   // deepest level the old run recorded, 0 for all
+    bool have_limit = false;
+    bool exceeded = false;
+    std::mutex m;
+};
+
+// watch.cpp
+void watch_tree(const NodePtr &root, size_t reportable_size, int interval,
+		const std::function<void()> &report);
+
+#endif
@@ -0,0 +1,105 @@
+
+/*********************************************************************
+
+ Result sharing: runs on the same tree within minutes of each other,
+ from cron, monitoring and people, can share one scan.
+
+ With -cache DIR every completed run publishes its snapshot there under
+ a name made of the device and a hash of the scanned path.  A run with
+ -max-age reads that snapshot instead of scanning when it is young
+ enough and kept enough detail, cut to the run's own -max-depth.
+ Scans hold an flock on a lock file beside it, so a run that finds no
+ fresh result while another is scanning waits for that one to publish
+ rather than starting its own.
+
+**********************************************************************/
+
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "bdb.h"
+
+ResultCache::ResultCache(const std::string &dir, const std::string &root,
+			 const Options &opts)
+    : root(root) {
+    struct stat buf;
+    const auto &source = opts.image.empty() ? root : opts.image;
+    if (stat(source.c_str(), &buf)) {
+	throw std::runtime_error("cannot stat " + source);
+    }
+    device = std::to_string(buf.st_dev);
+
+    char key[64];
+    snprintf(key, sizeof key, "/%s-%016zx", device.c_str(),
+	     std::hash<std::string>()(opts.image + '\n' + root));
+    file = dir + key + ".bdbs";
+
+    lock_fd = open((dir + key + ".lock").c_str(),
+		   O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (lock_fd < 0) {
+	throw std::runtime_error("cannot use cache directory " + dir);
+    }
+}
+
+ResultCache::~ResultCache() { close(lock_fd); }
+
+// drops what lies more than levels below node, as -max-depth would have
+static void trim(Node &node, const int levels) {
+    if (!levels) {
+	node.children.clear();
+	return;
+    }
+    for (auto &child : node.children) {
+	trim(*child, levels - 1);
+    }
+}
+
+NodePtr ResultCache::load(const long max_age, const Options &opts) {
+    std::unique_ptr<Snapshot> s;
+    try {
+	s.reset(new Snapshot(file));
+    } catch (const std::runtime_error &) {
+	return 0;
+    }
+    const auto time = s->header("time");
+    const auto depth = s->header("max-depth");
+    const bool usable =
+	s->header("device") == device &&
+	unescape_path(s->header("root").data(), s->header("root").size()) ==
+	    root &&
+	!time.empty() && std::time(0) - std::stol(time) <= max_age &&
+	snapshot_retain(*s) <= opts.retain &&
+	(depth.empty() || depth == "0" ||
+	 (opts.max_depth && std::stoi(depth) >= opts.max_depth));
+    if (!usable) {
+	return 0;
+    }
+    age = std::time(0) - std::stol(time);
+    auto tree = snapshot_tree(*s);
+    if (opts.max_depth) {
+	trim(*tree, opts.max_depth);
+    }
+    return tree;
+}
+
+NodePtr ResultCache::fresh(const long max_age, const Options &opts) {
+    if (auto cached = load(max_age, opts)) {
+	return cached;
+    }
+    // whoever holds the lock is scanning; its result may do for us
+    flock(lock_fd, LOCK_EX);
+    return load(max_age, opts);
+}
+
+void ResultCache::claim() { flock(lock_fd, LOCK_EX | LOCK_NB); }
+
+void ResultCache::publish(
+    const NodePtr &tree,
+    const std::vector<std::pair<std::string, std::string>> &header) {
+    write_snapshot(file, tree, header);
+    flock(lock_fd, LOCK_UN);
+}
@@ -0,0 +1,175 @@
+
+/*********************************************************************
+
+ Chargeback: bytes and inodes per cost center from the same scan.
+
+ A rules file has one "<center> <pattern>" line per rule, where the
+ pattern is an absolute path whose components may be fnmatch globs:
+
+    # center    pattern
+    search      /data/index
+    search      /data/search-*
+    ads         /data/ads*
+
+ A directory matching a pattern is charged to its center along with
+ everything beneath it, unless a deeper rule says otherwise.  Patterns
+ are compiled into a trie of components.  Where rules overlap, as a
+ glob and a literal at the same level do, a path can be at several
+ trie positions at once, so each directory steps from every position
+ of its parent's: the literal component, then each matching glob in
+ file order.  The first position reached that ends a rule names the
+ center.  Files are charged to the center of the directory holding
+ them.
+
+**********************************************************************/
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "bdb.h"
+
+namespace {
+
+std::vector<std::string> components(const std::string &path) {
+    std::vector<std::string> out;
+    std::stringstream in(path);
+    for (std::string c; std::getline(in, c, '/');) {
+	if (!c.empty()) {
+	    out.push_back(c);
+	}
+    }
+    return out;
+}
+
+} // namespace
+
+Chargeback::Chargeback(const std::string &rules) {
+    std::ifstream in(rules);
+    if (!in) {
+	throw std::runtime_error("cannot open rules: " + rules);
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(in, line); number++) {
+	std::istringstream fields(line);
+	std::string center, pattern, extra;
+	if (!(fields >> center) || center[0] == '#') {
+	    continue;
+	}
+	if (!(fields >> pattern) || pattern[0] != '/' || fields >> extra) {
+	    throw std::runtime_error(rules + ":" + std::to_string(number) +
+				     ": expected a center and an absolute path");
+	}
+
+	uint32_t at = 0;
+	for (auto &c : components(pattern)) {
+	    const bool glob = c.find_first_of("*?[") != std::string::npos;
+	    uint32_t next = 0; // the root is never a child
+	    if (!glob) {
+		auto found = trie[at].literal.find(c);
+		if (found != trie[at].literal.end()) {
+		    next = found->second;
+		}
+	    } else {
+		for (auto &g : trie[at].globs) {
+		    if (g.first == c) {
+			next = g.second;
+		    }
+		}
+	    }
+	    if (!next) {
+		next = trie.size();
+		if (glob) {
+		    trie[at].globs.emplace_back(c, next);
+		} else {
+		    trie[at].literal.emplace(c, next);
+		}
+		trie.emplace_back();
+	    }
+	    at = next;
+	}
+
+	auto known = std::find(centers.begin(), centers.end(), center);
+	trie[at].center = known - centers.begin();
+	if (known == centers.end()) {
+	    centers.push_back(center);
+	}
+    }
+
+    bytes.reset(new std::atomic<size_t>[centers.size() + 1]());
+    inodes.reset(new std::atomic<size_t>[centers.size() + 1]());
+}
+
+/*
+ * Position of the scanned directory, which may be given relative or lie
+ * beneath the patterns.
+ */
+Chargeback::Match Chargeback::start(const std::string &root) const {
+    char resolved[PATH_MAX];
+    const std::string path = realpath(root.c_str(), resolved) ? resolved : root;
+
+    Match m;
+    m.rules.push_back(0);
+    m.center = trie[0].center;
+    for (auto &c : components(path)) {
+	m = descend(m, c);
+    }
+    return m;
+}
+
+Chargeback::Match Chargeback::descend(const Match &parent,
+				      const std::string &name) const {
+    Match m;
+    for (auto rule : parent.rules) {
+	auto &r = trie[rule];
+	auto found = r.literal.find(name);
+	if (found != r.literal.end()) {
+	    m.rules.push_back(found->second);
+	}
+	for (auto &g : r.globs) {
+	    if (!fnmatch(g.first.c_str(), name.c_str(), 0)) {
+		m.rules.push_back(g.second);
+	    }
+	}
+    }
+    m.center = parent.center;
+    for (auto rule : m.rules) {
+	if (trie[rule].center >= 0) {
+	    m.center = trie[rule].center;
+	    break;
+	}
+    }
+    return m;
+}
+
+void Chargeback::charge(const Match &m, const Node &own) {
+    const size_t i = m.center < 0 ? centers.size() : m.center;
+    bytes[i] += own.size;
+    inodes[i] += own.inodes;
+}
+
+void Chargeback::print() const {
+    std::vector<size_t> order;
+    for (size_t i = 0; i <= centers.size(); i++) {
+	order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+	return bytes[a] > bytes[b];
+    });
+
+    ::printf("\nchargeback, GB and inodes per cost center\n");
+    for (auto i : order) {
+	if (i == centers.size() && !bytes[i] && !inodes[i]) {
+	    continue;
+	}
+	::printf("%s %.1f %zu\n",
+		 i < centers.size() ? centers[i].c_str() : "(none)",
+		 1.0 * bytes[i] / GB, inodes[i].load());
+    }
+}
@@ -0,0 +1,363 @@
+
+/*********************************************************************
+
+ Columnar export of the retained tree, for loading into analysis tools
+ with a memory map instead of a parser.
+
+ All integers are little-endian.  The file starts with a 96-byte
+ header:
+
+    0   char[8]  magic "BDBCOL1\0"
+    8   u64      rows (retained directories)
+   16   u64      names (distinct path components)
+   24   u64[8]   byte offset of each section below, in order
+   88   u64      zero
+
+ and continues with these sections, each starting at an offset that is
+ a multiple of 8:
+
+    parent   u32[rows]     row of the parent, 0xffffffff for the root
+    depth    u32[rows]     0 for the root
+    name     u32[rows]     index of the last path component; the root's
+			   "component" is its whole path
+    bytes    u64[rows]     allocated bytes of regular files beneath
+    inodes   u64[rows]     entries of any type beneath
+    mtime    i64[rows]     newest modification time beneath, in seconds
+    offsets  u64[names+1]  name i is text[offsets[i] .. offsets[i+1])
+    text     u8[]          component bytes, not terminated
+
+ Rows are in depth-first order with siblings sorted as in snapshots,
+ so a parent always precedes its children and every subtree is a
+ contiguous range of rows.
+
+ bdb search finds directories by name in these files without touching
+ the filesystem.  The dictionary is matched once, in slices across
+ threads: plain patterns as substrings, searched for in the whole text
+ section at once 16 bytes a step, globs with fnmatch per name.  Rows
+ whose name matched are then found by a pass over the name column.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bdb.h"
+
+namespace {
+
+const char MAGIC[8] = {'B', 'D', 'B', 'C', 'O', 'L', '1', '\0'};
+
+struct Columns {
+    std::vector<uint32_t> parent;
+    std::vector<uint32_t> depth;
+    std::vector<uint32_t> name;
+    std::vector<uint64_t> bytes;
+    std::vector<uint64_t> inodes;
+    std::vector<int64_t> mtime;
+    std::vector<uint64_t> offsets{0};
+    std::string text;
+    std::unordered_map<std::string, uint32_t> dictionary;
+
+    uint32_t intern(const std::string &component) {
+	auto found = dictionary.find(component);
+	if (found != dictionary.end()) {
+	    return found->second;
+	}
+	const uint32_t id = offsets.size() - 1;
+	dictionary.emplace(component, id);
+	text += component;
+	offsets.push_back(text.size());
+	return id;
+    }
+
+    void add(const Node &node, const uint32_t up, const uint32_t level,
+	     const std::string &component) {
+	const uint32_t row = parent.size();
+	parent.push_back(up);
+	depth.push_back(level);
+	name.push_back(intern(component));
+	bytes.push_back(node.size);
+	inodes.push_back(node.inodes);
+	mtime.push_back(node.mtime);
+
+	auto children = node.children;
+	std::sort(children.begin(), children.end(),
+		  [](const NodePtr &a, const NodePtr &b) {
+		      return path_before(a->fullpath.data(), a->fullpath.size(),
+					 b->fullpath.data(), b->fullpath.size());
+		  });
+	for (auto &child : children) {
+	    const auto &path = child->fullpath;
+	    add(*child, row, level + 1, path.substr(path.rfind('/') + 1));
+	}
+    }
+};
+
+template <typename T>
+void put(FILE *f, const std::vector<T> &column, uint64_t &at) {
+    ::fwrite(column.data(), sizeof(T), column.size(), f);
+    at += sizeof(T) * column.size();
+    static const char zeros[8] = {0};
+    const size_t pad = (8 - at % 8) % 8;
+    ::fwrite(zeros, 1, pad, f);
+    at += pad;
+}
+
+uint64_t padded(const uint64_t n) { return (n + 7) / 8 * 8; }
+
+/*
+ * A columnar file mapped read-only, with its header checked against its
+ * length.
+ */
+class Mapped {
+  public:
+    explicit Mapped(const std::string &file) {
+	const int fd = open(file.c_str(), O_RDONLY);
+	struct stat buf;
+	if (fd < 0 || fstat(fd, &buf)) {
+	    if (fd >= 0) {
+		close(fd);
+	    }
+	    throw std::runtime_error("cannot open columnar file: " + file);
+	}
+	length = buf.st_size;
+	auto mapped = length < 96 ? MAP_FAILED
+				  : mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+	    throw std::runtime_error(file + " is not a bdb columnar file");
+	}
+	data = static_cast<const char *>(mapped);
+
+	const uint64_t *header = reinterpret_cast<const uint64_t *>(data);
+	rows = header[1];
+	names = header[2];
+	bool valid = !memcmp(data, MAGIC, sizeof MAGIC);
+	const uint64_t sizes[8] = {4 * rows, 4 * rows, 4 * rows, 8 * rows,
+				   8 * rows, 8 * rows, 8 * (names + 1), 0};
+	for (int i = 0; valid && i < 8; i++) {
+	    valid = header[3 + i] <= length && sizes[i] <= length - header[3 + i];
+	    section[i] = data + header[3 + i];
+	}
+	valid = valid && this->offsets()[names] <= length - header[10];
+	if (!valid) {
+	    munmap(mapped, length);
+	    throw std::runtime_error(file + " is not a bdb columnar file");
+	}
+    }
+    ~Mapped() { munmap(const_cast<char *>(data), length); }
+    Mapped(const Mapped &) = delete;
+    Mapped &operator=(const Mapped &) = delete;
+
+    uint64_t rows;
+    uint64_t names;
+
+    const uint32_t *parent() const { return column<uint32_t>(0); }
+    const uint32_t *name() const { return column<uint32_t>(2); }
+    const uint64_t *bytes() const { return column<uint64_t>(3); }
+    const uint64_t *offsets() const { return column<uint64_t>(6); }
+    const char *text() const { return section[7]; }
+
+  private:
+    const char *data;
+    size_t length;
+    const char *section[8];
+
+    template <typename T> const T *column(const int i) const {
+	return reinterpret_cast<const T *>(section[i]);
+    }
+};
+
+/*
+ * Start of every occurrence of needle in [p, p + n), comparing the
+ * first and last byte of the needle at 16 positions a step and only
+ * checking the rest where both agree.
+ */
+void find_all(const char *p, const size_t n, const std::string &needle,
+	      std::vector<size_t> &out) {
+    const size_t k = needle.size();
+    if (k > n) {
+	return;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[k - 1]);
+    for (; i + k - 1 + 16 <= n; i += 16) {
+	auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+	auto b = _mm_loadu_si128(
+	    reinterpret_cast<const __m128i *>(p + i + k - 1));
+	unsigned mask = _mm_movemask_epi8(
+	    _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+	while (mask) {
+	    const int bit = __builtin_ctz(mask);
+	    if (!memcmp(p + i + bit + 1, needle.data() + 1, k - 1)) {
+		out.push_back(i + bit);
+	    }
+	    mask &= mask - 1;
+	}
+    }
+#endif
+    for (; i + k <= n; i++) {
+	if (!memcmp(p + i, needle.data(), k)) {
+	    out.push_back(i);
+	}
+    }
+}
+
+/*
+ * Marks the names in [from, to) that match the pattern.
+ */
+void match_names(const Mapped &m, const std::string &pattern, const bool glob,
+		 const uint64_t from, const uint64_t to,
+		 std::vector<char> &matched) {
+    const auto offsets = m.offsets();
+    if (glob) {
+	std::string name;
+	for (auto i = from; i < to; i++) {
+	    name.assign(m.text() + offsets[i], offsets[i + 1] - offsets[i]);
+	    matched[i] = !fnmatch(pattern.c_str(), name.c_str(), 0);
+	}
+	return;
+    }
+    std::vector<size_t> hits;
+    const auto base = offsets[from];
+    find_all(m.text() + base, offsets[to] - base, pattern, hits);
+    for (auto h : hits) {
+	const auto at = base + h;
+	const auto i = std::upper_bound(offsets + from, offsets + to + 1, at) -
+		       offsets - 1;
+	if (at + pattern.size() <= offsets[i + 1]) { // not across names
+	    matched[i] = 1;
+	}
+    }
+}
+
+std::string full_path(const Mapped &m, uint32_t row) {
+    std::vector<uint32_t> up;
+    for (; row != 0xffffffff; row = m.parent()[row]) {
+	up.push_back(row);
+    }
+    std::string path;
+    for (auto r = up.rbegin(); r != up.rend(); ++r) {
+	const auto name = m.name()[*r];
+	if (!path.empty() && path.back() != '/') {
+	    path += '/';
+	}
+	path.append(m.text() + m.offsets()[name],
+		    m.offsets()[name + 1] - m.offsets()[name]);
+    }
+    return path;
+}
+
+} // namespace
+
+void write_columnar(const std::string &file, const NodePtr &root) {
+    Columns c;
+    c.add(*root, 0xffffffff, 0, root->fullpath);
+
+    const uint64_t rows = c.parent.size();
+    const uint64_t names = c.offsets.size() - 1;
+
+    uint64_t header[12] = {0};
+    memcpy(header, MAGIC, sizeof MAGIC);
+    header[1] = rows;
+    header[2] = names;
+    uint64_t at = sizeof header;
+    const uint64_t sizes[8] = {4 * rows, 4 * rows, 4 * rows, 8 * rows,
+			       8 * rows, 8 * rows, 8 * (names + 1),
+			       c.text.size()};
+    for (int i = 0; i < 8; i++) {
+	header[3 + i] = at;
+	at += padded(sizes[i]);
+    }
+
+    const auto temporary = file + ".tmp." + std::to_string(getpid());
+    auto f = ::fopen(temporary.c_str(), "wb");
+    if (!f) {
+	throw std::runtime_error("cannot write columnar file: " + temporary);
+    }
+    ::fwrite(header, sizeof header, 1, f);
+    at = sizeof header;
+    put(f, c.parent, at);
+    put(f, c.depth, at);
+    put(f, c.name, at);
+    put(f, c.bytes, at);
+    put(f, c.inodes, at);
+    put(f, c.mtime, at);
+    put(f, c.offsets, at);
+    put(f, std::vector<char>(c.text.begin(), c.text.end()), at);
+
+    if (::fclose(f) || rename(temporary.c_str(), file.c_str())) {
+	unlink(temporary.c_str());
+	throw std::runtime_error("cannot write columnar file: " + file);
+    }
+}
+
+void search_columnar(const std::string &pattern,
+		     const std::vector<std::string> &files, const int threads) {
+    if (pattern.empty()) {
+	throw std::runtime_error("search needs a pattern");
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const bool glob = pattern.find_first_of("*?[") != std::string::npos;
+    size_t found = 0;
+    size_t searched = 0;
+
+    for (auto &file : files) {
+	Mapped m(file);
+	std::vector<char> matched(m.names);
+
+	// slices of the dictionary with about the same number of bytes
+	std::vector<uint64_t> bounds{0};
+	const auto offsets = m.offsets();
+	for (int t = 1; t < threads; t++) {
+	    const auto at = std::lower_bound(offsets, offsets + m.names,
+					     offsets[m.names] * t / threads) -
+			    offsets;
+	    bounds.push_back(std::max<uint64_t>(at, bounds.back()));
+	}
+	bounds.push_back(m.names);
+
+	std::vector<std::future<void>> parts;
+	for (size_t i = 0; i + 1 < bounds.size(); i++) {
+	    parts.push_back(std::async(std::launch::async, match_names,
+				       std::cref(m), std::cref(pattern), glob,
+				       bounds[i], bounds[i + 1],
+				       std::ref(matched)));
+	}
+	for (auto &p : parts) {
+	    p.get();
+	}
+
+	for (uint64_t row = 0; row < m.rows; row++) {
+	    if (matched[m.name()[row]]) {
+		::printf("%s %.1f\n", full_path(m, row).c_str(),
+			 1.0 * m.bytes()[row] / GB);
+		found++;
+	    }
+	}
+	searched += m.rows;
+    }
+
+    std::chrono::duration<double> elapsed =
+	std::chrono::steady_clock::now() - start;
+    ::fprintf(stderr, "%zu of %zu directories in %.1f ms\n", found, searched,
+	      elapsed.count() * 1000);
+}
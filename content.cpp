@@ -0,0 +1,258 @@
+
+/*********************************************************************
+
+ Estimates that need file contents rather than metadata.
+
+ Reading is expensive, so only files of at least a minimum size are
+ looked at, only a few sampled chunks of each, and never more in total
+ than the I/O budget.  Pages read are dropped from the cache again so
+ that sampling does not evict anything useful.
+
+**********************************************************************/
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bdb.h"
+
+namespace {
+
+const size_t CHUNK = 64 * 1024;
+const int CHUNKS = 4;
+
+// Claims up to want bytes of the shared budget, returning how many.
+size_t claim(const Options &opts, Stats *stats, const size_t want) {
+    const size_t before = stats->io_spent.fetch_add(want);
+    if (before >= opts.io_budget) {
+	stats->io_spent -= want;
+	return 0;
+    }
+    const size_t granted = std::min(want, opts.io_budget - before);
+    stats->io_spent -= want - granted;
+    return granted;
+}
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/*
+ * Size a general purpose compressor would get a block down to, modelled
+ * on LZ77 with entropy-coded literals: each 4-byte repeat found through
+ * a small hash table costs three bytes, every other byte costs the
+ * order-0 entropy of the block.
+ */
+double compressed_size(const uint8_t *p, const size_t n) {
+    if (n < 16) {
+	return n;
+    }
+
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++) {
+	counts[p[i]]++;
+    }
+    double bits = 0;
+    for (auto c : counts) {
+	if (c) {
+	    bits -= c * std::log2(1.0 * c / n);
+	}
+    }
+    const double literal_cost = bits / n / 8;
+
+    static const int HASH_BITS = 13;
+    uint32_t table[1 << HASH_BITS] = {0};
+    size_t literals = 0;
+    size_t matches = 0;
+    size_t i = 0;
+
+    while (i + 4 <= n) {
+	const uint32_t v = read32(p + i);
+	const uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+	const size_t candidate = table[h];
+	table[h] = i + 1;
+
+	if (candidate && i + 1 - candidate <= 65535 &&
+	    read32(p + candidate - 1) == v) {
+	    size_t length = 4;
+	    while (i + length < n &&
+		   p[candidate - 1 + length] == p[i + length]) {
+		length++;
+	    }
+	    matches++;
+	    i += length;
+	} else {
+	    literals++;
+	    i++;
+	}
+    }
+    literals += n - i;
+
+    return literals * literal_cost + matches * 3.0;
+}
+
+/*
+ * Whether n bytes, a multiple of 64, are all zero.  Data blocks are
+ * rarely zero, so look at the first 16 bytes before the full pass.
+ */
+bool all_zero(const uint8_t *p, const size_t n) {
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    auto is_zero = [&](__m128i v) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0xffff;
+    };
+    if (!is_zero(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)))) {
+	return false;
+    }
+    __m128i acc = zero;
+    for (size_t i = 0; i < n; i += 64) {
+	auto q = reinterpret_cast<const __m128i *>(p + i);
+	acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(q),
+					     _mm_loadu_si128(q + 1)));
+	acc = _mm_or_si128(acc, _mm_or_si128(_mm_loadu_si128(q + 2),
+					     _mm_loadu_si128(q + 3)));
+    }
+    return is_zero(acc);
+#else
+    if (read32(p) | read32(p + 4) | read32(p + 8) | read32(p + 12)) {
+	return false;
+    }
+    uint64_t acc = 0; // a plain reduction, which compilers vectorize
+    for (size_t i = 0; i < n; i += sizeof acc) {
+	uint64_t v;
+	memcpy(&v, p + i, sizeof v);
+	acc |= v;
+    }
+    return !acc;
+#endif
+}
+
+} // namespace
+
+void sample_compression(const std::string &path, const struct stat &buf,
+			const Options &opts, Stats *stats, Node &own) {
+    const size_t allocated = buf.st_blocks * 512;
+    if (!allocated) {
+	return;
+    }
+
+    const int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+	return;
+    }
+
+    std::vector<uint8_t> chunk(CHUNK);
+    double read = 0;
+    double compressed = 0;
+
+    for (int c = 0; c < CHUNKS; c++) {
+	const size_t want = claim(opts, stats, CHUNK);
+	if (!want) {
+	    break;
+	}
+	const off_t span = std::max<off_t>(buf.st_size - off_t(want), 0);
+	const off_t offset = span * c / (CHUNKS - 1); // first to last byte
+	const auto n = pread(fd, chunk.data(), want, offset);
+	if (n <= 0) {
+	    stats->io_spent -= want;
+	    break;
+	}
+	stats->io_spent -= want - n;
+	read += n;
+	compressed += compressed_size(chunk.data(), n);
+    }
+
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+
+    if (read) {
+	const double ratio = std::min(1.0, compressed / read);
+	own.compress_sampled += allocated;
+	own.compress_saving += size_t(allocated * (1 - ratio));
+	stats->sampled_files++;
+    }
+}
+
+/*
+ * Allocated blocks that hold nothing but zeros could be punched out to
+ * make the file sparse.  Holes the file already has are skipped with
+ * SEEK_DATA/SEEK_HOLE; the data regions are read in full, as far as the
+ * budget allows, and checked one filesystem block at a time.
+ */
+void scan_zero_blocks(const std::string &path, const struct stat &buf,
+		      const Options &opts, Stats *stats, Node &own) {
+    const size_t block = std::max<size_t>(buf.st_blksize, 64) / 64 * 64;
+    if (!buf.st_blocks) {
+	return;
+    }
+
+    const int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+	return;
+    }
+
+    const size_t READ = 1024 * 1024 / block * block;
+    std::vector<uint8_t> data(READ);
+    bool examined = false;
+
+    for (off_t start = 0; start < buf.st_size;) {
+	off_t end = buf.st_size;
+#ifdef SEEK_DATA
+	start = lseek(fd, start, SEEK_DATA);
+	if (start < 0) {
+	    break; // nothing but hole to the end
+	}
+	end = lseek(fd, start, SEEK_HOLE);
+	if (end < 0) {
+	    end = buf.st_size;
+	}
+#endif
+	start = start / block * block;
+
+	while (start < end) {
+	    const size_t want = claim(
+		opts, stats, std::min<off_t>(READ, (end - start + block - 1) /
+							block * block));
+	    if (!want) {
+		goto out;
+	    }
+	    const auto n = pread(fd, data.data(), want, start);
+	    if (n <= 0) {
+		stats->io_spent -= want;
+		goto out;
+	    }
+	    stats->io_spent -= want - n;
+	    examined = true;
+
+	    own.sparse_examined += n;
+	    for (size_t b = 0; b + block <= size_t(n); b += block) {
+		if (all_zero(data.data() + b, block)) {
+		    own.sparse_zero += block;
+		}
+	    }
+	    start += n;
+	}
+    }
+
+out:
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+
+    if (examined) {
+	stats->sparse_files++;
+    }
+}
@@ -0,0 +1,157 @@
+
+/*********************************************************************
+
+ Which directories explain the growth between two snapshots?
+
+ Every ancestor of a growing directory grows too, so a plain diff
+ repeats the same bytes at each level.  Instead pick a small set of
+ deep, non-overlapping directories that together account for a chosen
+ fraction of the growth of the root.
+
+ The two snapshots are merged in one pass (both are sorted by path
+ component), which yields the growth of every recorded directory with
+ parents ahead of their children.  A directory recorded in only one
+ snapshot was below the other's retention floor there, so its growth
+ is taken as the least it can have been, and no directory is credited
+ with more than its parent grew.  Selection then starts from the root
+ and greedily replaces a directory by its few largest growing children
+ whenever the growth left behind still fits in the allowed shortfall,
+ largest directories first.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+
+#include "bdb.h"
+
+namespace {
+
+struct Change {
+    std::string path;
+    double growth;
+    std::vector<size_t> children;
+};
+
+bool is_ancestor(const std::string &a, const char *path, size_t len) {
+    if (a.size() >= len || memcmp(a.data(), path, a.size())) {
+	return false;
+    }
+    return a.back() == '/' || path[a.size()] == '/';
+}
+
+std::vector<Change> merge(const Snapshot &older, const Snapshot &newer) {
+    std::vector<Change> changes;
+    std::vector<size_t> ancestors;
+    const double floor = snapshot_retain(older);
+
+    auto &a = older.records();
+    auto &b = newer.records();
+    size_t i = 0, j = 0;
+
+    while (i < a.size() || j < b.size()) {
+	const Snapshot::Record *r;
+	double growth;
+	if (j == b.size() ||
+	    (i < a.size() &&
+	     path_before(a[i].path, a[i].length, b[j].path, b[j].length))) {
+	    r = &a[i++];
+	    growth = -1.0 * r->bytes; // now anywhere from 0 to the new floor
+	} else if (i == a.size() ||
+		   path_before(b[j].path, b[j].length, a[i].path, a[i].length)) {
+	    r = &b[j++];
+	    growth = r->bytes - floor; // was anywhere from 0 to the old floor
+	} else {
+	    growth = 1.0 * b[j].bytes - a[i].bytes;
+	    r = &b[j++];
+	    i++;
+	}
+
+	while (!ancestors.empty() &&
+	       !is_ancestor(changes[ancestors.back()].path, r->path,
+			    r->length)) {
+	    ancestors.pop_back();
+	}
+	if (!ancestors.empty()) {
+	    auto &parent = changes[ancestors.back()];
+	    parent.children.push_back(changes.size());
+	    growth = std::min(growth, std::max(parent.growth, 0.0));
+	} else if (!changes.empty()) {
+	    throw std::runtime_error("snapshots do not share a root");
+	}
+	ancestors.push_back(changes.size());
+	changes.push_back({std::string(r->path, r->length), growth, {}});
+    }
+    return changes;
+}
+
+} // namespace
+
+void explain_growth(const Snapshot &older, const Snapshot &newer,
+		    const double percent) {
+    auto changes = merge(older, newer);
+    if (changes.empty() || changes[0].growth <= 0) {
+	::fprintf(stderr, "no growth\n");
+	return;
+    }
+
+    const double total = changes[0].growth;
+    double slack = total - total * percent / 100 + 0.5; // bytes to spare
+
+    auto smaller = [&](size_t x, size_t y) {
+	return changes[x].growth < changes[y].growth;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(smaller)>
+	pending(smaller);
+    pending.push(0);
+
+    std::vector<size_t> chosen;
+
+    while (!pending.empty()) {
+	const auto n = pending.top();
+	pending.pop();
+
+	std::vector<size_t> growing;
+	for (auto c : changes[n].children) {
+	    if (changes[c].growth > 0) {
+		growing.push_back(c);
+	    }
+	}
+	std::sort(growing.begin(), growing.end(),
+		  [&](size_t x, size_t y) { return smaller(y, x); });
+
+	double covered = 0;
+	size_t k = 0;
+	while (k < growing.size() && changes[n].growth - covered > slack) {
+	    covered += changes[growing[k++]].growth;
+	}
+
+	const double loss = changes[n].growth - covered;
+	if (k && loss <= slack) {
+	    slack -= std::max(loss, 0.0);
+	    for (size_t i = 0; i < k; i++) {
+		pending.push(growing[i]);
+	    }
+	} else {
+	    chosen.push_back(n);
+	}
+    }
+
+    std::sort(chosen.begin(), chosen.end(),
+	      [&](size_t x, size_t y) { return smaller(y, x); });
+
+    double explained = 0;
+    for (auto n : chosen) {
+	auto &c = changes[n];
+	explained += c.growth;
+	const auto path = unescape_path(c.path.data(), c.path.size());
+	::printf("%s %.1f %.0f%%\n", path.c_str(), c.growth / GB,
+		 100 * c.growth / total);
+    }
+    ::fprintf(stderr, "%zu director%s explain %.0f%% of %.1f GB growth\n",
+	      chosen.size(), chosen.size() == 1 ? "y" : "ies",
+	      100 * explained / total, total / GB);
+}
@@ -0,0 +1,559 @@
+
+/*********************************************************************
+
+ Offline scan of an ext2/3/4 image file.
+
+ Rather than walking a loop mount, read the on-disk metadata directly:
+ first every group's inode table in order, then every directory block
+ sorted by physical location, so that the image is read nearly
+ sequentially.  Totals follow the same rules as the directory walk:
+ regular files contribute st_blocks * 512 once per name, directories
+ contribute nothing of their own, and everything else is ignored.
+
+ Layout references are to Documentation/filesystems/ext4 in the kernel.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bdb.h"
+
+namespace {
+
+const uint32_t ROOT_INO = 2;
+
+const uint32_t INCOMPAT_FILETYPE = 0x2;
+const uint32_t INCOMPAT_META_BG = 0x10;
+const uint32_t INCOMPAT_64BIT = 0x80;
+const uint32_t RO_COMPAT_HUGE_FILE = 0x8;
+const uint32_t RO_COMPAT_GDT_CSUM = 0x10;
+const uint32_t RO_COMPAT_METADATA_CSUM = 0x400;
+
+const uint16_t BG_INODE_UNINIT = 0x1;
+
+const uint32_t HUGE_FILE_FL = 0x40000;
+const uint32_t EXTENTS_FL = 0x80000;
+const uint32_t INLINE_DATA_FL = 0x10000000;
+
+const uint8_t FT_REG = 1;
+const uint8_t FT_DIR = 2;
+
+// Regular file sizes are kept in 512-byte units in 32 bits per inode;
+// the rare file beyond that goes to a side table.
+const uint32_t BIG_FILE = 0xffffffff;
+
+uint16_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+struct Directory {
+    uint32_t ino;
+    uint64_t size;
+    uint32_t flags;
+    uint8_t block[60];      // i_block: extent tree, block map or inline
+    std::string inline_xattr; // remainder of inline data, if any
+    uint64_t own;           // bytes of regular files directly inside
+    uint64_t entries;       // names directly inside
+    uint32_t newest;        // latest mtime among them
+    std::vector<std::pair<uint32_t, std::string>> subdirs;
+};
+
+struct Extent {
+    uint64_t physical;
+    uint32_t count;
+    uint32_t dir; // index into Image::dirs
+};
+
+class Image {
+  public:
+    explicit Image(const std::string &path) : path(path) {
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+	    throw std::runtime_error("cannot open image: " + path);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	read_superblock();
+	read_group_descriptors();
+    }
+
+    ~Image() { close(fd); }
+
+    NodePtr scan(const std::string &root, const Options &opts,
+		 Stats *stats) {
+	read_inode_tables();
+	read_directory_blocks();
+	return build(root, opts, stats);
+    }
+
+  private:
+    std::string path;
+    int fd;
+
+    uint64_t block_size;
+    uint32_t inodes_count;
+    uint32_t inodes_per_group;
+    uint32_t inode_size;
+    uint32_t groups;
+    uint32_t incompat;
+    uint32_t ro_compat;
+    std::vector<uint64_t> inode_tables;
+    std::vector<uint32_t> inodes_in_use;
+
+    std::vector<uint32_t> file_blocks; // 512-byte units per regular inode
+    std::vector<uint32_t> mtimes;      // per in-use inode
+    std::unordered_map<uint32_t, uint64_t> big_files;
+    std::vector<Directory> dirs;
+    std::unordered_map<uint32_t, uint32_t> dir_index;
+    size_t files = 0;
+
+    void read_at(uint64_t offset, void *buf, size_t len) const {
+	auto p = static_cast<char *>(buf);
+	while (len) {
+	    auto n = pread(fd, p, len, offset);
+	    if (n <= 0) {
+		throw std::runtime_error("short read in image: " + path);
+	    }
+	    p += n;
+	    offset += n;
+	    len -= n;
+	}
+    }
+
+    void read_superblock() {
+	uint8_t sb[1024];
+	read_at(1024, sb, sizeof sb);
+
+	if (le16(sb + 0x38) != 0xef53) {
+	    throw std::runtime_error(path + " is not an ext2/3/4 image");
+	}
+
+	inodes_count = le32(sb + 0x0);
+	uint64_t blocks_count = le32(sb + 0x4);
+	const uint32_t first_data_block = le32(sb + 0x14);
+	const uint32_t log_block_size = le32(sb + 0x18);
+	if (log_block_size > 6) { // ext4 blocks are at most 64 KB
+	    throw std::runtime_error(path + ": corrupt superblock");
+	}
+	block_size = 1024ull << log_block_size;
+	const uint32_t blocks_per_group = le32(sb + 0x20);
+	inodes_per_group = le32(sb + 0x28);
+	inode_size = le32(sb + 0x4c) ? le16(sb + 0x58) : 128;
+	incompat = le32(sb + 0x60);
+	ro_compat = le32(sb + 0x64);
+
+	if (incompat & INCOMPAT_64BIT) {
+	    blocks_count |= uint64_t(le32(sb + 0x150)) << 32;
+	}
+	if (incompat & INCOMPAT_META_BG) {
+	    throw std::runtime_error(path + ": meta_bg is not supported");
+	}
+	if (!blocks_per_group || !inodes_per_group) {
+	    throw std::runtime_error(path + ": corrupt superblock");
+	}
+
+	groups = (blocks_count - first_data_block + blocks_per_group - 1) /
+		 blocks_per_group;
+	first_descriptor = (first_data_block + 1) * block_size;
+	descriptor_size = (incompat & INCOMPAT_64BIT) ? le16(sb + 0xfe) : 32;
+	if (descriptor_size < 32) {
+	    descriptor_size = 32;
+	}
+    }
+
+    uint64_t first_descriptor;
+    uint32_t descriptor_size;
+
+    void read_group_descriptors() {
+	std::vector<uint8_t> table(uint64_t(groups) * descriptor_size);
+	read_at(first_descriptor, table.data(), table.size());
+
+	const bool checksummed =
+	    ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM);
+
+	for (uint32_t g = 0; g < groups; g++) {
+	    const uint8_t *d = table.data() + uint64_t(g) * descriptor_size;
+	    uint64_t itable = le32(d + 0x8);
+	    uint32_t unused = le16(d + 0x1c);
+	    if (descriptor_size >= 64) {
+		itable |= uint64_t(le32(d + 0x28)) << 32;
+		unused |= uint32_t(le16(d + 0x32)) << 16;
+	    }
+	    uint32_t used = inodes_per_group;
+	    if (checksummed) {
+		used = (le16(d + 0x12) & BG_INODE_UNINIT)
+			   ? 0
+			   : inodes_per_group - std::min(unused, inodes_per_group);
+	    }
+	    inode_tables.push_back(itable);
+	    inodes_in_use.push_back(used);
+	}
+    }
+
+    void read_inode_tables() {
+	file_blocks.assign(uint64_t(inodes_count) + 1, 0);
+	mtimes.assign(uint64_t(inodes_count) + 1, 0);
+	std::vector<uint8_t> table;
+
+	for (uint32_t g = 0; g < groups; g++) {
+	    table.resize(uint64_t(inodes_in_use[g]) * inode_size);
+	    if (table.empty()) {
+		continue;
+	    }
+	    read_at(inode_tables[g] * block_size, table.data(), table.size());
+
+	    for (uint32_t i = 0; i < inodes_in_use[g]; i++) {
+		const uint8_t *inode = table.data() + uint64_t(i) * inode_size;
+		const uint32_t ino = g * inodes_per_group + i + 1;
+		const uint16_t mode = le16(inode + 0x0);
+
+		if (!mode || !le16(inode + 0x1a) || ino > inodes_count) {
+		    continue; // free or deleted
+		}
+		mtimes[ino] = le32(inode + 0x10);
+
+		if ((mode & 0xf000) == 0x8000) {
+		    note_file(ino, inode);
+		} else if ((mode & 0xf000) == 0x4000) {
+		    note_directory(ino, inode);
+		}
+	    }
+	}
+    }
+
+    void note_file(const uint32_t ino, const uint8_t *inode) {
+	const uint32_t flags = le32(inode + 0x20);
+	uint64_t blocks = le32(inode + 0x1c);
+	if (ro_compat & RO_COMPAT_HUGE_FILE) {
+	    blocks |= uint64_t(le16(inode + 0x74)) << 32;
+	    if (flags & HUGE_FILE_FL) {
+		blocks *= block_size / 512;
+	    }
+	}
+	if (blocks >= BIG_FILE) {
+	    file_blocks[ino] = BIG_FILE;
+	    big_files[ino] = blocks;
+	} else {
+	    file_blocks[ino] = blocks;
+	}
+    }
+
+    void note_directory(const uint32_t ino, const uint8_t *inode) {
+	Directory dir;
+	dir.ino = ino;
+	dir.size = le32(inode + 0x4) | uint64_t(le32(inode + 0x6c)) << 32;
+	dir.flags = le32(inode + 0x20);
+	memcpy(dir.block, inode + 0x28, sizeof dir.block);
+	dir.own = 0;
+	dir.entries = 0;
+	dir.newest = 0;
+
+	if (dir.flags & INLINE_DATA_FL) {
+	    dir.inline_xattr = inline_data_xattr(inode);
+	}
+
+	dir_index[ino] = dirs.size();
+	dirs.push_back(std::move(dir));
+    }
+
+    /*
+     * Inline directories longer than i_block continue in the in-inode
+     * extended attribute "system.data".
+     */
+    std::string inline_data_xattr(const uint8_t *inode) const {
+	if (inode_size <= 128) {
+	    return "";
+	}
+	const uint32_t start = 128 + le16(inode + 0x80);
+	if (start + 4 > inode_size || le32(inode + start) != 0xea020000) {
+	    return "";
+	}
+	const uint8_t *first = inode + start + 4;
+	const uint8_t *end = inode + inode_size;
+
+	for (const uint8_t *e = first; e + 16 <= end && le32(e) != 0;) {
+	    const uint8_t name_len = e[0];
+	    const uint8_t index = e[1];
+	    const uint16_t value_offs = le16(e + 2);
+	    const uint32_t value_size = le32(e + 8);
+	    if (e + 16 + name_len > end) {
+		break;
+	    }
+	    if (index == 7 && name_len == 4 && !memcmp(e + 16, "data", 4) &&
+		first + value_offs + value_size <= end) {
+		return std::string(
+		    reinterpret_cast<const char *>(first + value_offs),
+		    value_size);
+	    }
+	    e += (16 + name_len + 3) & ~3u;
+	}
+	return "";
+    }
+
+    // Physical extents of a directory, in logical order, up to its size.
+    void map_blocks(const Directory &dir, const uint32_t index,
+		    std::vector<Extent> &out) const {
+	const uint64_t wanted = (dir.size + block_size - 1) / block_size;
+	if (dir.flags & EXTENTS_FL) {
+	    walk_extents(dir.block, sizeof dir.block, index, wanted, out, 0);
+	} else {
+	    uint64_t logical = 0;
+	    for (int i = 0; i < 12 && logical < wanted; i++, logical++) {
+		add_block(le32(dir.block + 4 * i), index, out);
+	    }
+	    for (int level = 1; level <= 3 && logical < wanted; level++) {
+		walk_indirect(le32(dir.block + 4 * (11 + level)), level, index,
+			      wanted, logical, out);
+	    }
+	}
+    }
+
+    static void add_block(const uint64_t physical, const uint32_t index,
+			  std::vector<Extent> &out) {
+	if (!physical) {
+	    return;
+	}
+	if (!out.empty() && out.back().dir == index &&
+	    out.back().physical + out.back().count == physical) {
+	    out.back().count++;
+	} else {
+	    out.push_back({physical, 1, index});
+	}
+    }
+
+    void walk_indirect(const uint32_t block, const int level,
+		       const uint32_t index, const uint64_t wanted,
+		       uint64_t &logical, std::vector<Extent> &out) const {
+	uint64_t span = 1;
+	for (int i = 1; i < level; i++) {
+	    span *= block_size / 4;
+	}
+	if (!block) {
+	    logical += span * (block_size / 4);
+	    return;
+	}
+	std::vector<uint8_t> buf(block_size);
+	read_at(block * block_size, buf.data(), buf.size());
+	for (uint64_t i = 0; i < block_size / 4 && logical < wanted; i++) {
+	    const uint32_t next = le32(buf.data() + 4 * i);
+	    if (level == 1) {
+		add_block(next, index, out);
+		logical++;
+	    } else {
+		walk_indirect(next, level - 1, index, wanted, logical, out);
+	    }
+	}
+    }
+
+    // Extents in a node of length bytes: the inode's i_block or a block.
+    void walk_extents(const uint8_t *header, const size_t length,
+		      const uint32_t index, const uint64_t wanted,
+		      std::vector<Extent> &out, const int level) const {
+	if (le16(header) != 0xf30a || level > 5) {
+	    return;
+	}
+	const uint16_t entries = le16(header + 2);
+	const uint16_t max = le16(header + 4);
+	const uint16_t depth = le16(header + 6);
+	if (entries > max || max > (length - 12) / 12) {
+	    throw std::runtime_error(path + ": corrupt extent tree");
+	}
+
+	for (uint16_t i = 0; i < entries; i++) {
+	    const uint8_t *e = header + 12 + 12 * i;
+	    const uint32_t logical = le32(e);
+	    if (logical >= wanted) {
+		break;
+	    }
+	    if (depth == 0) {
+		uint32_t len = le16(e + 4);
+		if (len > 32768) {
+		    continue; // unwritten extent reads as zeros
+		}
+		len = std::min<uint64_t>(len, wanted - logical);
+		const uint64_t start =
+		    le32(e + 8) | uint64_t(le16(e + 6)) << 32;
+		if (!out.empty() && out.back().dir == index &&
+		    out.back().physical + out.back().count == start) {
+		    out.back().count += len;
+		} else {
+		    out.push_back({start, len, index});
+		}
+	    } else {
+		const uint64_t leaf = le32(e + 4) | uint64_t(le16(e + 8)) << 32;
+		std::vector<uint8_t> buf(block_size);
+		read_at(leaf * block_size, buf.data(), buf.size());
+		walk_extents(buf.data(), buf.size(), index, wanted, out,
+			     level + 1);
+	    }
+	}
+    }
+
+    void read_directory_blocks() {
+	std::vector<Extent> extents;
+	for (uint32_t i = 0; i < dirs.size(); i++) {
+	    if (dirs[i].flags & INLINE_DATA_FL) {
+		// i_block opens with the parent's inode number
+		parse_entries(dirs[i], dirs[i].block + 4, 56);
+		parse_entries(dirs[i],
+			      reinterpret_cast<const uint8_t *>(
+				  dirs[i].inline_xattr.data()),
+			      dirs[i].inline_xattr.size());
+		dirs[i].inline_xattr.clear();
+	    } else {
+		map_blocks(dirs[i], i, extents);
+	    }
+	}
+
+	std::sort(extents.begin(), extents.end(),
+		  [](const Extent &a, const Extent &b) {
+		      return a.physical < b.physical;
+		  });
+
+	std::vector<uint8_t> buf;
+	for (auto &e : extents) {
+	    buf.resize(e.count * block_size);
+	    read_at(e.physical * block_size, buf.data(), buf.size());
+	    for (uint32_t b = 0; b < e.count; b++) {
+		parse_entries(dirs[e.dir], buf.data() + b * block_size,
+			      block_size);
+	    }
+	}
+    }
+
+    void parse_entries(Directory &dir, const uint8_t *p, const size_t len) {
+	const bool typed = incompat & INCOMPAT_FILETYPE;
+
+	for (size_t off = 0; off + 8 <= len;) {
+	    const uint8_t *e = p + off;
+	    const uint32_t ino = le32(e);
+	    uint32_t rec_len = le16(e + 4);
+	    if (block_size >= 65536 && (rec_len == 65535 || rec_len == 0)) {
+		rec_len = block_size;
+	    }
+	    const size_t name_len = typed ? e[6] : le16(e + 6);
+	    if (rec_len < 8 || off + rec_len > len || 8 + name_len > rec_len) {
+		break;
+	    }
+	    off += rec_len;
+
+	    if (!ino || ino > inodes_count) {
+		continue; // empty slot, htree node or checksum tail
+	    }
+	    const std::string name(reinterpret_cast<const char *>(e + 8),
+				   name_len);
+	    if (name == "." || name == "..") {
+		continue;
+	    }
+	    dir.entries++;
+	    dir.newest = std::max(dir.newest, mtimes[ino]);
+
+	    const uint8_t type = typed ? e[7] : 0;
+	    if (type == FT_DIR || (!typed && dir_index.count(ino))) {
+		if (dir_index.count(ino)) {
+		    dir.subdirs.emplace_back(ino, name);
+		}
+	    } else if (type == FT_REG || (!typed && file_blocks[ino])) {
+		dir.own += file_bytes(ino);
+		files++;
+	    }
+	}
+    }
+
+    uint64_t file_bytes(const uint32_t ino) const {
+	const uint32_t blocks = file_blocks[ino];
+	if (blocks == BIG_FILE) {
+	    return big_files.at(ino) * 512;
+	}
+	return uint64_t(blocks) * 512;
+    }
+
+    /*
+     * Post-order over the directory graph from the root, applying the
+     * same retention rule as the live scan.
+     */
+    NodePtr build(const std::string &root, const Options &opts,
+		  Stats *stats) {
+	if (!dir_index.count(ROOT_INO)) {
+	    throw std::runtime_error(path + ": root directory not found");
+	}
+
+	struct Frame {
+	    uint32_t dir;
+	    size_t next;
+	    int depth;
+	    Node node;
+	};
+	std::vector<bool> seen(dirs.size());
+	std::vector<Frame> stack;
+	stack.push_back({dir_index[ROOT_INO], 0, 0, Node()});
+	stack.back().node.fullpath = root;
+	seen[stack.back().dir] = true;
+
+	for (;;) {
+	    auto &top = stack.back();
+	    auto &dir = dirs[top.dir];
+
+	    if (top.next < dir.subdirs.size()) {
+		const auto &sub = dir.subdirs[top.next++];
+		auto found = dir_index.find(sub.first);
+		if (found == dir_index.end() || seen[found->second]) {
+		    continue;
+		}
+		seen[found->second] = true;
+		Frame frame{found->second, 0, top.depth + 1, Node()};
+		frame.node.fullpath =
+		    top.node.fullpath +
+		    (top.node.fullpath.back() == '/' ? "" : "/") + sub.second;
+		stack.push_back(std::move(frame));
+		continue;
+	    }
+
+	    top.node.size += dir.own;
+	    top.node.inodes += dir.entries;
+	    top.node.mtime = std::max<time_t>(top.node.mtime, dir.newest);
+	    stats->directories++;
+
+	    auto done = std::move(stack.back());
+	    stack.pop_back();
+	    if (done.depth >= 1) {
+		stats->retained -= prune_insignificant(opts, done.node);
+	    }
+	    if (opts.finished) {
+		opts.finished(done.node);
+	    }
+
+	    if (stack.empty()) {
+		stats->files += files;
+		stats->retained++;
+		return std::make_shared<Node>(std::move(done.node));
+	    }
+
+	    auto &parent = stack.back().node;
+	    absorb(parent, done.node);
+	    if (worth_keeping(opts, done.depth, done.node.size)) {
+		parent.children.push_back(
+		    std::make_shared<Node>(std::move(done.node)));
+		stats->retained++;
+	    }
+	}
+    }
+};
+
+} // namespace
+
+NodePtr scan_ext4_image(const std::string &image, const std::string &root,
+			const Options &opts, Stats *stats) {
+    Image fs(image);
+    return fs.scan(root, opts, stats);
+}
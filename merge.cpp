@@ -0,0 +1,170 @@
+
+/*********************************************************************
+
+ bdb merge: combine snapshots from many hosts with the same layout.
+
+ For every path recorded on any host, print the total over all hosts,
+ the largest single host's share, how many hosts recorded it and the
+ hosts contributing most:
+
+    /data/app/logs 812.4 40.2 200 web17:40.2,web03:38.9,web44:31.0
+
+ Snapshots are sorted by path, so they are combined with a k-way
+ merge.  The path space is cut into ranges at evenly spaced paths of
+ the largest snapshot and each thread merges one range, writing its
+ lines to its own buffer; the buffers are printed in order.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <queue>
+#include <stdexcept>
+
+#include "bdb.h"
+
+namespace {
+
+struct Host {
+    std::string name;
+    std::unique_ptr<Snapshot> snapshot;
+};
+
+struct Cursor {
+    const Snapshot::Record *at;
+    const Snapshot::Record *end;
+    size_t host;
+};
+
+bool record_before(const Snapshot::Record &a, const Snapshot::Record &b) {
+    return path_before(a.path, a.length, b.path, b.length);
+}
+
+bool same_path(const Snapshot::Record &a, const Snapshot::Record &b) {
+    return a.length == b.length && !memcmp(a.path, b.path, a.length);
+}
+
+/*
+ * Merges the records of every host in [from, to), where a null bound
+ * means the start or end of the path space.
+ */
+std::string merge_range(const std::vector<Host> &hosts,
+			const Snapshot::Record *from,
+			const Snapshot::Record *to, const size_t top) {
+    auto later = [](const Cursor &a, const Cursor &b) {
+	return record_before(*b.at, *a.at);
+    };
+    std::priority_queue<Cursor, std::vector<Cursor>, decltype(later)> heap(
+	later);
+
+    for (size_t h = 0; h < hosts.size(); h++) {
+	auto &rows = hosts[h].snapshot->records();
+	auto begin = rows.data();
+	auto end = rows.data() + rows.size();
+	if (from) {
+	    begin = std::lower_bound(begin, end, *from, record_before);
+	}
+	if (to) {
+	    end = std::lower_bound(begin, end, *to, record_before);
+	}
+	if (begin != end) {
+	    heap.push({begin, end, h});
+	}
+    }
+
+    std::string out;
+    std::vector<std::pair<size_t, size_t>> contributors; // bytes, host
+    char buf[64];
+
+    while (!heap.empty()) {
+	const Snapshot::Record current = *heap.top().at;
+	contributors.clear();
+
+	while (!heap.empty() && same_path(*heap.top().at, current)) {
+	    auto c = heap.top();
+	    heap.pop();
+	    contributors.emplace_back(c.at->bytes, c.host);
+	    if (++c.at != c.end) {
+		heap.push(c);
+	    }
+	}
+
+	size_t sum = 0;
+	for (auto &c : contributors) {
+	    sum += c.first;
+	}
+	const size_t shown = std::min(top, contributors.size());
+	std::partial_sort(contributors.begin(), contributors.begin() + shown,
+			  contributors.end(),
+			  [](const std::pair<size_t, size_t> &a,
+			     const std::pair<size_t, size_t> &b) {
+			      return a.first > b.first ||
+				     (a.first == b.first && a.second < b.second);
+			  });
+
+	out += unescape_path(current.path, current.length);
+	snprintf(buf, sizeof buf, " %.1f %.1f %zu ", 1.0 * sum / GB,
+		 1.0 * contributors[0].first / GB, contributors.size());
+	out += buf;
+	for (size_t i = 0; i < shown; i++) {
+	    snprintf(buf, sizeof buf, ":%.1f", 1.0 * contributors[i].first / GB);
+	    out += (i ? "," : "") + hosts[contributors[i].second].name + buf;
+	}
+	out += '\n';
+    }
+    return out;
+}
+
+} // namespace
+
+void merge_snapshots(const std::vector<std::string> &files, const int threads,
+		     const size_t top) {
+    if (files.empty()) {
+	throw std::runtime_error("merge needs snapshot files");
+    }
+
+    std::vector<std::future<Host>> loading;
+    for (auto &file : files) {
+	loading.push_back(std::async(std::launch::async, [file]() {
+	    Host h;
+	    h.snapshot.reset(new Snapshot(file));
+	    h.name = h.snapshot->header("host");
+	    if (h.name.empty()) {
+		h.name = file;
+	    }
+	    return h;
+	}));
+    }
+    std::vector<Host> hosts;
+    for (auto &f : loading) {
+	hosts.push_back(f.get());
+    }
+
+    auto largest = std::max_element(
+	hosts.begin(), hosts.end(), [](const Host &a, const Host &b) {
+	    return a.snapshot->records().size() < b.snapshot->records().size();
+	});
+    auto &rows = largest->snapshot->records();
+
+    std::vector<const Snapshot::Record *> bounds{nullptr};
+    for (int t = 1; t < threads && !rows.empty(); t++) {
+	auto at = &rows[rows.size() * t / threads];
+	if (bounds.back() != at) {
+	    bounds.push_back(at);
+	}
+    }
+    bounds.push_back(nullptr);
+
+    std::vector<std::future<std::string>> parts;
+    for (size_t i = 0; i + 1 < bounds.size(); i++) {
+	parts.push_back(std::async(std::launch::async, merge_range,
+				   std::cref(hosts), bounds[i], bounds[i + 1],
+				   top));
+    }
+    for (auto &p : parts) {
+	auto text = p.get();
+	::fwrite(text.data(), 1, text.size(), stdout);
+    }
+}
@@ -0,0 +1,138 @@
+
+/*********************************************************************
+
+ Explain the difference between what the filesystem says is used and
+ what the scan found.  The usual culprit is a file that has been
+ unlinked while some process still holds it open: it keeps its blocks
+ but has no name for the walk to find.  Those are found through
+ /proc/PID/fd, so only processes we may inspect are seen.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "bdb.h"
+
+static std::string process_name(const std::string &pid) {
+    std::string name;
+    if (auto f = ::fopen(("/proc/" + pid + "/comm").c_str(), "r")) {
+	char buf[64];
+	if (::fgets(buf, sizeof buf, f)) {
+	    name = buf;
+	    if (!name.empty() && name.back() == '\n') {
+		name.pop_back();
+	    }
+	}
+	::fclose(f);
+    }
+    return name.empty() ? "?" : name;
+}
+
+static bool numeric(const char *s) {
+    for (; *s; s++) {
+	if (*s < '0' || *s > '9') {
+	    return false;
+	}
+    }
+    return true;
+}
+
+Reconciliation reconcile_filesystem(const std::string &dir) {
+    Reconciliation r;
+
+    struct stat root;
+    struct statvfs fs;
+    if (stat(dir.c_str(), &root) || statvfs(dir.c_str(), &fs)) {
+	throw std::runtime_error("cannot stat filesystem of " + dir);
+    }
+    r.used = size_t(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+
+    struct stat parent;
+    r.mount_point = dir == "/" || stat((dir + "/..").c_str(), &parent) ||
+		    parent.st_dev != root.st_dev;
+
+    auto proc = opendir("/proc");
+    if (!proc) {
+	return r;
+    }
+
+    std::set<ino_t> counted;
+
+    for (dirent *p; (p = readdir(proc)) != 0;) {
+	if (!numeric(p->d_name)) {
+	    continue;
+	}
+	const std::string pid = p->d_name;
+	const std::string fds = "/proc/" + pid + "/fd";
+
+	auto dirp = opendir(fds.c_str());
+	if (!dirp) {
+	    r.unreadable++;
+	    continue;
+	}
+
+	HeldOpen held;
+	held.pid = std::atol(pid.c_str());
+
+	for (dirent *entry; (entry = readdir(dirp)) != 0;) {
+	    if (!numeric(entry->d_name)) {
+		continue;
+	    }
+	    // stat follows the magic link to the open file itself
+	    struct stat buf;
+	    if (stat((fds + "/" + entry->d_name).c_str(), &buf) ||
+		buf.st_dev != root.st_dev || !S_ISREG(buf.st_mode) ||
+		buf.st_nlink != 0) {
+		continue;
+	    }
+	    held.files++;
+	    held.bytes += buf.st_blocks * 512;
+	    if (counted.insert(buf.st_ino).second) {
+		r.held += buf.st_blocks * 512;
+	    }
+	}
+	closedir(dirp);
+
+	if (held.files) {
+	    held.command = process_name(pid);
+	    r.holders.push_back(held);
+	}
+    }
+    closedir(proc);
+
+    std::sort(r.holders.begin(), r.holders.end(),
+	      [](const HeldOpen &a, const HeldOpen &b) {
+		  return a.bytes > b.bytes;
+	      });
+    return r;
+}
+
+void print_reconciliation(const Reconciliation &r, const size_t scanned) {
+    const double gap = 1.0 * r.used - scanned;
+
+    ::printf("\nfilesystem used %.1f GB, scanned %.1f GB, difference %.1f GB\n",
+	     1.0 * r.used / GB, 1.0 * scanned / GB, gap / GB);
+    if (!r.mount_point) {
+	::printf("  (the scan did not start at the mount point)\n");
+    }
+
+    ::printf("deleted but open %.1f GB\n", 1.0 * r.held / GB);
+    for (auto &h : r.holders) {
+	::printf("  %ld %s %.1f GB in %zu file%s\n", h.pid, h.command.c_str(),
+		 1.0 * h.bytes / GB, h.files, h.files == 1 ? "" : "s");
+    }
+    if (r.unreadable) {
+	::printf("  (%zu processes could not be inspected)\n", r.unreadable);
+    }
+
+    ::printf("unexplained %.1f GB (metadata, less hard links seen twice)\n",
+	     (gap - r.held) / GB);
+}
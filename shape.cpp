@@ -0,0 +1,254 @@
+
+/*********************************************************************
+
+ Shapes: what a scanned tree looks like to the scanner, without any
+ names or contents, so that scans can be studied away from the data.
+
+ A shape file starts with "#bdb-shape 1" and has one line per
+ directory in order of discovery, so that a parent always comes first:
+
+    <parent> <microseconds> <other> [<bucket>:<files>]...
+
+ The parent is a line number counted from 0 for the root, whose parent
+ is -1.  Microseconds is how long listing and statting the directory's
+ own entries took, other is the number of entries that are neither
+ directories nor regular files, and the buckets count regular files
+ by log2 of their size as in -histogram.
+
+ bdb replay runs a shape through the scanner itself, with a lister
+ that makes up each directory's entries and sleeps for its recorded
+ time instead of reading anything, to see how the shape parallelizes
+ with given threads, frontier, descriptor budget and prefetching.  A
+ directory prefetched before its turn costs nothing when listed.
+ bdb materialize builds it as a real tree of empty directories,
+ symlinks and sparse files for scanning.
+
+**********************************************************************/
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bdb.h"
+
+static const char MAGIC[] = "#bdb-shape 1";
+
+size_t ShapeRecorder::add(const size_t parent) {
+    std::lock_guard<std::mutex> guard(m);
+    directories.emplace_back();
+    directories.back().parent = parent;
+    return directories.size() - 1;
+}
+
+void ShapeRecorder::finish(const size_t id, Directory d) {
+    std::lock_guard<std::mutex> guard(m);
+    d.parent = directories[id].parent;
+    directories[id] = d;
+}
+
+void ShapeRecorder::write(const std::string &file) const {
+    const auto temporary = file + ".tmp." + std::to_string(getpid());
+    auto f = ::fopen(temporary.c_str(), "w");
+    if (!f) {
+	throw std::runtime_error("cannot write shape: " + temporary);
+    }
+    ::fprintf(f, "%s\n", MAGIC);
+    for (auto &d : directories) {
+	::fprintf(f, "%ld %zu %zu", d.parent == NONE ? -1L : long(d.parent),
+		  d.micros, d.other);
+	for (int b = 0; b < 65; b++) {
+	    if (d.files[b]) {
+		::fprintf(f, " %d:%u", b, d.files[b]);
+	    }
+	}
+	::fprintf(f, "\n");
+    }
+    if (::fclose(f) || rename(temporary.c_str(), file.c_str())) {
+	unlink(temporary.c_str());
+	throw std::runtime_error("cannot write shape: " + file);
+    }
+}
+
+std::vector<ShapeRecorder::Directory>
+ShapeRecorder::read(const std::string &file) {
+    std::ifstream in(file);
+    std::string line;
+    if (!std::getline(in, line) || line != MAGIC) {
+	throw std::runtime_error(file + " is not a bdb shape");
+    }
+    std::vector<Directory> shape;
+    while (std::getline(in, line)) {
+	std::istringstream fields(line);
+	long parent;
+	Directory d;
+	if (!(fields >> parent >> d.micros >> d.other) || parent < -1 ||
+	    parent >= long(shape.size()) || (parent < 0) != shape.empty()) {
+	    throw std::runtime_error(file + ": malformed line " +
+				     std::to_string(shape.size() + 2));
+	}
+	d.parent = parent < 0 ? NONE : parent;
+	int b;
+	char colon;
+	unsigned count;
+	while (fields >> b >> colon >> count) {
+	    if (b < 0 || b > 63 || colon != ':') {
+		throw std::runtime_error(file + ": bad bucket");
+	    }
+	    d.files[b] = count;
+	}
+	shape.push_back(d);
+    }
+    if (shape.empty()) {
+	throw std::runtime_error(file + ": empty shape");
+    }
+    return shape;
+}
+
+namespace {
+
+// apparent size of the n-th file in a bucket, spread over [2^(b-1), 2^b)
+off_t file_size(const int b, const size_t n) {
+    const off_t low = b ? off_t(1) << (b - 1) : 0;
+    return low + (b > 1 ? (n * 2654435761u) % low : 0);
+}
+
+/*
+ * Directories of a shape as the scanner sees them: the root is "/" and
+ * directory i is named d<i>, as materialize names them.
+ */
+class ShapeLister : public Lister {
+  public:
+    explicit ShapeLister(const std::vector<ShapeRecorder::Directory> &shape)
+	: shape(shape), children(shape.size()),
+	  warmed(new std::atomic<bool>[shape.size()]()) {
+	for (size_t i = 1; i < shape.size(); i++) {
+	    children[shape[i].parent].push_back(i);
+	}
+    }
+
+    void list(const std::string &dir,
+	      const std::function<void(const Entry &)> &each) override {
+	const size_t id = number(dir);
+	if (!warmed[id]) {
+	    std::this_thread::sleep_for(
+		std::chrono::microseconds(shape[id].micros));
+	}
+	const auto prefix = dir + (dir.back() == '/' ? "" : "/");
+
+	Entry e;
+	memset(&e.buf, 0, sizeof e.buf);
+	e.type = DT_DIR;
+	e.buf.st_mode = S_IFDIR | 0755;
+	for (auto c : children[id]) {
+	    e.path = prefix + "d" + std::to_string(c);
+	    each(e);
+	}
+	e.type = DT_REG;
+	e.buf.st_mode = S_IFREG | 0644;
+	size_t n = 0;
+	for (int b = 0; b < 65; b++) {
+	    for (unsigned k = 0; k < shape[id].files[b]; k++, n++) {
+		e.path = prefix + "f" + std::to_string(n);
+		e.buf.st_size = file_size(b, n);
+		e.buf.st_blocks = (e.buf.st_size + 4095) / 4096 * 8;
+		each(e);
+	    }
+	}
+	e.type = DT_LNK;
+	e.buf.st_mode = S_IFLNK | 0777;
+	e.buf.st_size = e.buf.st_blocks = 0;
+	for (size_t l = 0; l < shape[id].other; l++) {
+	    e.path = prefix + "l" + std::to_string(l);
+	    each(e);
+	}
+    }
+
+    void warm(const std::string &dir) override {
+	const size_t id = number(dir);
+	std::this_thread::sleep_for(std::chrono::microseconds(shape[id].micros));
+	warmed[id] = true;
+    }
+
+  private:
+    const std::vector<ShapeRecorder::Directory> &shape;
+    std::vector<std::vector<size_t>> children;
+    std::unique_ptr<std::atomic<bool>[]> warmed;
+
+    static size_t number(const std::string &dir) {
+	const auto slash = dir.rfind('/');
+	return slash + 1 < dir.size() ? std::stoul(dir.substr(slash + 2)) : 0;
+    }
+};
+
+} // namespace
+
+void replay_shape(const std::string &file, const Options &opts, Stats *stats) {
+    const auto shape = ShapeRecorder::read(file);
+    double recorded = 0;
+    for (auto &d : shape) {
+	recorded += d.micros / 1e6;
+    }
+
+    ShapeLister lister(shape);
+    const auto start = std::chrono::steady_clock::now();
+    scan_listed(lister, "/", 0, 4096, opts, stats);
+    std::chrono::duration<double> elapsed =
+	std::chrono::steady_clock::now() - start;
+
+    ::printf("%zu directories, %.2f s recorded, replayed with %d threads "
+	     "in %.2f s, %.0f directories/s\n",
+	     shape.size(), recorded, opts.threads, elapsed.count(),
+	     shape.size() / elapsed.count());
+}
+
+/*
+ * Directories are d<line>, files f<n> and other entries dangling
+ * symlinks l<n>.  Files get an apparent size inside their bucket but
+ * no blocks, so the tree costs metadata only.
+ */
+void materialize_shape(const std::string &file, const std::string &dir) {
+    const auto shape = ShapeRecorder::read(file);
+    std::vector<std::string> paths(shape.size());
+    size_t made = 0;
+
+    for (size_t i = 0; i < shape.size(); i++) {
+	auto &d = shape[i];
+	paths[i] = i ? paths[d.parent] + "/d" + std::to_string(i) : dir;
+	if (mkdir(paths[i].c_str(), 0755) && (i || errno != EEXIST)) {
+	    throw std::runtime_error("cannot create " + paths[i]);
+	}
+	for (size_t n = 0; n < d.other; n++) {
+	    const auto link = paths[i] + "/l" + std::to_string(n);
+	    if (symlink("nowhere", link.c_str())) {
+		throw std::runtime_error("cannot create " + link);
+	    }
+	}
+	size_t n = 0;
+	for (int b = 0; b < 65; b++) {
+	    for (unsigned k = 0; k < d.files[b]; k++, n++) {
+		const auto path = paths[i] + "/f" + std::to_string(n);
+		const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+				    0644);
+		if (fd < 0 || ftruncate(fd, file_size(b, n))) {
+		    if (fd >= 0) {
+			close(fd);
+		    }
+		    throw std::runtime_error("cannot create " + path);
+		}
+		close(fd);
+		made++;
+	    }
+	}
+    }
+    ::fprintf(stderr, "%zu directories, %zu files\n", shape.size(), made);
+}
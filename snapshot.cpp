@@ -0,0 +1,398 @@
+
+/*********************************************************************
+
+ Snapshots: the retained tree of one run, kept for later comparison.
+
+ A snapshot is a text file.  Header lines start with '#' and hold
+ "key value" pairs; the first is "#bdb-snapshot 1".  Every other line
+ is "<bytes> <path>" for one retained directory, with backslash and
+ newline in paths escaped as \\ and \n.  Records are sorted by path,
+ one component at a time, so that a directory is immediately followed
+ by everything beneath it and snapshots can be merged in one pass.
+
+ Snapshots are read through mmap and looked up by binary search, so
+ that comparing against one costs neither a parse into a tree nor a
+ copy of the paths.
+
+**********************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bdb.h"
+
+static const char MAGIC[] = "#bdb-snapshot 1";
+
+bool path_before(const char *a, size_t alen, const char *b, size_t blen) {
+    const size_t n = std::min(alen, blen);
+    for (size_t i = 0; i < n; i++) {
+	if (a[i] != b[i]) {
+	    // '/' ends a component, so it sorts before every other byte
+	    if (a[i] == '/') {
+		return true;
+	    }
+	    if (b[i] == '/') {
+		return false;
+	    }
+	    return static_cast<unsigned char>(a[i]) <
+		   static_cast<unsigned char>(b[i]);
+	}
+    }
+    return alen < blen;
+}
+
+std::string escape_path(const std::string &path) {
+    if (path.find_first_of("\\\n") == std::string::npos) {
+	return path;
+    }
+    std::string out;
+    for (char c : path) {
+	if (c == '\\') {
+	    out += "\\\\";
+	} else if (c == '\n') {
+	    out += "\\n";
+	} else {
+	    out += c;
+	}
+    }
+    return out;
+}
+
+std::string unescape_path(const char *p, const size_t len) {
+    std::string out;
+    out.reserve(len);
+    for (size_t i = 0; i < len; i++) {
+	if (p[i] == '\\' && i + 1 < len) {
+	    out += p[++i] == 'n' ? '\n' : p[i];
+	} else {
+	    out += p[i];
+	}
+    }
+    return out;
+}
+
+Snapshot::Snapshot(const std::string &file) : file(file) {
+    const int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+	throw std::runtime_error("cannot open snapshot: " + file);
+    }
+    struct stat buf;
+    if (fstat(fd, &buf)) {
+	close(fd);
+	throw std::runtime_error("cannot stat snapshot: " + file);
+    }
+    length = buf.st_size;
+    if (length < sizeof MAGIC - 1) {
+	close(fd);
+	throw std::runtime_error(file + " is not a bdb snapshot");
+    }
+    auto mapped = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+	throw std::runtime_error("cannot map snapshot: " + file);
+    }
+    data = static_cast<const char *>(mapped);
+
+    if (memcmp(data, MAGIC, sizeof MAGIC - 1)) {
+	munmap(mapped, length);
+	throw std::runtime_error(file + " is not a bdb snapshot");
+    }
+
+    bool sorted = true;
+    for (const char *p = data, *end = data + length; p < end;) {
+	const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+	if (!eol) {
+	    eol = end;
+	}
+	if (*p == '#') {
+	    const char *space = static_cast<const char *>(
+		memchr(p, ' ', eol - p));
+	    if (space) {
+		headers.emplace_back(std::string(p + 1, space),
+				     std::string(space + 1, eol));
+	    }
+	} else if (p < eol) {
+	    char *after;
+	    Record r;
+	    r.bytes = std::strtoull(p, &after, 10);
+	    if (after == p || after >= eol || *after != ' ') {
+		munmap(const_cast<char *>(data), length);
+		throw std::runtime_error(file + ": malformed record");
+	    }
+	    r.path = after + 1;
+	    r.length = eol - r.path;
+	    if (!rows.empty() && !path_before(rows.back().path,
+					       rows.back().length, r.path,
+					       r.length)) {
+		sorted = false;
+	    }
+	    rows.push_back(r);
+	}
+	p = eol + 1;
+    }
+
+    if (!sorted) {
+	std::sort(rows.begin(), rows.end(), [](const Record &a, const Record &b) {
+	    return path_before(a.path, a.length, b.path, b.length);
+	});
+    }
+}
+
+Snapshot::~Snapshot() { munmap(const_cast<char *>(data), length); }
+
+std::string Snapshot::header(const std::string &key) const {
+    for (auto &h : headers) {
+	if (h.first == key) {
+	    return h.second;
+	}
+    }
+    return "";
+}
+
+const Snapshot::Record *Snapshot::find(const std::string &path) const {
+    const auto key = escape_path(path);
+    auto found = std::lower_bound(
+	rows.begin(), rows.end(), key, [](const Record &r, const std::string &k) {
+	    return path_before(r.path, r.length, k.data(), k.size());
+	});
+    if (found == rows.end() || found->length != key.size() ||
+	memcmp(found->path, key.data(), key.size())) {
+	return 0;
+    }
+    return &*found;
+}
+
+/*
+ * Levels path lies below root, both spelled alike.
+ */
+static int depth_below(const std::string &root, const std::string &path) {
+    if (path.size() <= root.size()) {
+	return 0;
+    }
+    return std::count(path.begin() + root.size(), path.end(), '/') +
+	   (root == "/");
+}
+
+static bool beneath(const std::string &top, const std::string &path) {
+    return path.size() > top.size() && !path.compare(0, top.size(), top) &&
+	   (top == "/" || path[top.size()] == '/');
+}
+
+static void collect(const NodePtr &node,
+		    std::vector<std::pair<std::string, size_t>> &out) {
+    out.emplace_back(escape_path(node->fullpath), node->size);
+    for (auto &child : node->children) {
+	collect(child, out);
+    }
+}
+
+static void
+write_rows(const std::string &file,
+	   std::vector<std::pair<std::string, size_t>> &rows,
+	   const std::vector<std::pair<std::string, std::string>> &header) {
+    std::sort(rows.begin(), rows.end(),
+	      [](const std::pair<std::string, size_t> &a,
+		 const std::pair<std::string, size_t> &b) {
+		  return path_before(a.first.data(), a.first.size(),
+				     b.first.data(), b.first.size());
+	      });
+
+    // write beside the target and rename, so readers never see half
+    const auto temporary = file + ".tmp." + std::to_string(getpid());
+    auto f = ::fopen(temporary.c_str(), "w");
+    if (!f) {
+	throw std::runtime_error("cannot write snapshot: " + temporary);
+    }
+    ::fprintf(f, "%s\n", MAGIC);
+    for (auto &h : header) {
+	::fprintf(f, "#%s %s\n", h.first.c_str(), h.second.c_str());
+    }
+    for (auto &r : rows) {
+	::fprintf(f, "%zu %s\n", r.second, r.first.c_str());
+    }
+    if (::fclose(f) || rename(temporary.c_str(), file.c_str())) {
+	unlink(temporary.c_str());
+	throw std::runtime_error("cannot write snapshot: " + file);
+    }
+}
+
+void write_snapshot(const std::string &file, const NodePtr &root,
+		    const std::vector<std::pair<std::string, std::string>> &header) {
+    std::vector<std::pair<std::string, size_t>> rows;
+    collect(root, rows);
+    write_rows(file, rows, header);
+}
+
+size_t snapshot_retain(const Snapshot &snapshot) {
+    const auto retain = snapshot.header("retain");
+    return retain.empty() ? GB : std::stoull(retain);
+}
+
+/*
+ * The retained tree a snapshot was written from, as far as it recorded:
+ * sizes only.  Records are sorted so that each directory directly
+ * follows its parent or one of the parent's descendants.
+ */
+NodePtr snapshot_tree(const Snapshot &snapshot) {
+    NodePtr root;
+    std::vector<NodePtr> open;
+    for (auto &r : snapshot.records()) {
+	auto node = std::make_shared<Node>();
+	node->fullpath = unescape_path(r.path, r.length);
+	node->size = r.bytes;
+	while (!open.empty() && !beneath(open.back()->fullpath, node->fullpath)) {
+	    open.pop_back();
+	}
+	if (open.empty() && root) {
+	    throw std::runtime_error(snapshot.header("root") +
+				     ": records outside the root");
+	}
+	if (open.empty()) {
+	    root = node;
+	} else {
+	    open.back()->children.push_back(node);
+	}
+	open.push_back(node);
+    }
+    if (!root) {
+	throw std::runtime_error("empty snapshot");
+    }
+    return root;
+}
+
+/*
+ * Throws unless rescanning dir alone can bring the snapshot up to date:
+ * its old total must be on record to know how far its ancestors move.
+ */
+void check_update(const Snapshot &old, const std::string &dir) {
+    const auto root = old.header("root");
+    const auto top = escape_path(dir);
+    if (top != root && !beneath(root, top)) {
+	throw std::runtime_error(dir + " is not beneath " + root);
+    }
+    if (!old.find(dir)) {
+	throw std::runtime_error(dir + " is not in the snapshot, update a "
+				       "larger directory above it");
+    }
+    const auto depth = old.header("max-depth");
+    if (!depth.empty() && depth != "0") {
+	throw std::runtime_error("cannot update a snapshot taken with -max-depth");
+    }
+}
+
+/*
+ * Replaces the records of a rescanned subtree and moves every recorded
+ * ancestor by the change in its total.  Records are kept or dropped by
+ * the same rule a full scan uses, with depths counted from the
+ * snapshot's root, so the result is what a full rescan would have
+ * written if nothing outside the subtree had changed.
+ */
+void update_snapshot(const std::string &file, const Snapshot &old,
+		     const NodePtr &subtree,
+		     const std::pair<std::string, std::string> &note) {
+    check_update(old, subtree->fullpath);
+    const auto root = old.header("root");
+    const auto top = escape_path(subtree->fullpath);
+    const size_t retain = snapshot_retain(old);
+    const auto before = old.find(subtree->fullpath);
+
+    auto kept = [&](const std::string &path, const size_t bytes) {
+	return depth_below(root, path) <= 1 || bytes >= retain;
+    };
+
+    std::vector<std::pair<std::string, size_t>> rows;
+    for (auto &r : old.records()) {
+	std::string path(r.path, r.length);
+	if (path == top || beneath(top, path)) {
+	    continue;
+	}
+	size_t bytes = r.bytes;
+	if (beneath(path, top)) {
+	    bytes += subtree->size - before->bytes; // wraps when shrinking
+	}
+	if (kept(path, bytes)) {
+	    rows.emplace_back(std::move(path), bytes);
+	}
+    }
+
+    std::vector<std::pair<std::string, size_t>> scanned;
+    collect(subtree, scanned);
+    for (auto &r : scanned) {
+	if (kept(r.first, r.second)) {
+	    rows.push_back(std::move(r));
+	}
+    }
+
+    std::vector<std::pair<std::string, std::string>> header;
+    for (auto &h : old.header_lines()) {
+	if (h.first != "bdb-snapshot") { // write_rows adds the magic line
+	    header.push_back(h);
+	}
+    }
+    header.push_back(note);
+    write_rows(file, rows, header);
+}
+
+Threshold parse_threshold(const std::string &text) {
+    Threshold t;
+    size_t used;
+    t.value = std::stod(text, &used);
+    t.percent = used < text.size() && text[used] == '%';
+    if (used + t.percent != text.size() || t.value < 0) {
+	throw std::runtime_error("bad threshold: " + text);
+    }
+    return t;
+}
+
+GrowthReport::GrowthReport(const Snapshot &previous, const Threshold &report)
+    : previous(previous), report(report) {
+    retained = snapshot_retain(previous);
+    const auto depth = previous.header("max-depth");
+    max_depth = depth.empty() ? 0 : std::stoi(depth);
+    root = previous.header("root");
+    root = unescape_path(root.data(), root.size());
+}
+
+/*
+ * Growth is only meaningful where we know the old total: directories in
+ * the old snapshot, or new ones large enough that the old run would
+ * have recorded them.
+ */
+void GrowthReport::finished(const Node &node) {
+    auto old = previous.find(node.fullpath);
+    if (!old && node.size < retained) {
+	return;
+    }
+    if (!old && max_depth && depth_below(root, node.fullpath) > max_depth) {
+	return;
+    }
+    const size_t before = old ? old->bytes : 0;
+    if (node.size <= before) {
+	return;
+    }
+    const double growth = node.size - before;
+
+    auto over = [&](const Threshold &t) {
+	if (t.percent) {
+	    return !before || growth * 100 >= t.value * before;
+	}
+	return growth >= t.value * GB;
+    };
+
+    std::lock_guard<std::mutex> guard(m);
+    if (over(report)) {
+	::printf("%s %.1f\n", node.fullpath.c_str(), growth / GB);
+    }
+    if (have_limit && over(limit)) {
+	exceeded = true;
+    }
+}
@@ -0,0 +1,328 @@
+
+/*********************************************************************
+
+ Keep the report current after the scan with inotify, which needs no
+ privileges, unlike fanotify filesystem marks.
+
+ Only the directories that made the report are watched, then their
+ direct subdirectories while the user's watch limit allows.  Each
+ watched directory keeps the allocated size of the regular files
+ directly in it; an event for one of them is followed by an lstat,
+ and the difference is added to the nearest reported directory at or
+ above it and to every directory above that.  Writes through a memory
+ map raise no event, so every interval each watched directory is also
+ listed again and its files re-statted before the report is printed.
+
+ A directory that appears after the scan, created or moved in, is
+ counted in full when it arrives: its files are watched like the rest
+ if its parent is reported, and everything below its subdirectories
+ is charged to the parent as one sum, taken back if it goes again.
+
+ Changes further down than the watched levels are not seen; a later
+ full scan or -update picks them up.
+
+**********************************************************************/
+
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bdb.h"
+
+namespace {
+
+const uint32_t EVENTS = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+			IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |
+			IN_DONT_FOLLOW;
+
+struct Watched {
+    std::string path;
+    std::vector<Node *> chain; // reported directory at or above, upwards
+    bool reported;             // whether new subdirectories get watched
+    std::unordered_map<std::string, size_t> files; // allocated bytes
+    std::unordered_map<std::string, size_t> trees; // beneath arrivals
+};
+
+size_t allocated(const std::string &path) {
+    struct stat buf;
+    if (lstat(path.c_str(), &buf) || !S_ISREG(buf.st_mode)) {
+	return 0;
+    }
+    return buf.st_blocks * 512;
+}
+
+// allocated bytes of the files in subdirectories, and optionally in path
+size_t beneath(const std::string &path, const bool own_files) {
+    size_t total = 0;
+    if (auto dirp = opendir(path.c_str())) {
+	while (auto entry = readdir(dirp)) {
+	    const std::string name = entry->d_name;
+	    if (entry->d_type == DT_DIR && name != "." && name != "..") {
+		total += beneath(path + "/" + name, true);
+	    } else if (entry->d_type == DT_REG && own_files) {
+		total += allocated(path + "/" + name);
+	    }
+	}
+	closedir(dirp);
+    }
+    return total;
+}
+
+class Watcher {
+  public:
+    Watcher() : fd(inotify_init1(IN_CLOEXEC)) {
+	if (fd < 0) {
+	    throw std::runtime_error("cannot initialize inotify");
+	}
+    }
+    ~Watcher() { close(fd); }
+
+    /*
+     * False once the watch limit is reached.  Files of a directory that
+     * was scanned are already in the totals; those of one that arrived
+     * later are charged now.
+     */
+    bool add(const std::string &path, const std::vector<Node *> &chain,
+	     const bool reported, const bool scanned = true) {
+	const int wd = inotify_add_watch(fd, path.c_str(), EVENTS);
+	if (wd < 0) {
+	    return errno != ENOSPC;
+	}
+	if (watches.count(wd)) {
+	    return true; // the same directory under another name
+	}
+	auto &w = watches[wd];
+	w.path = path;
+	w.chain = chain;
+	w.reported = reported;
+	if (scanned) {
+	    w.files = list(path);
+	} else {
+	    relist(w);
+	}
+	return true;
+    }
+
+    size_t size() const { return watches.size(); }
+
+    // waits up to timeout ms for events, returning whether totals moved
+    bool wait(const int timeout) {
+	pollfd p = {fd, POLLIN, 0};
+	if (poll(&p, 1, timeout) <= 0) {
+	    return false;
+	}
+	alignas(inotify_event) char buf[64 * 1024];
+	const auto n = read(fd, buf, sizeof buf);
+	bool moved = false;
+	for (ssize_t at = 0; at < n;) {
+	    auto e = reinterpret_cast<const inotify_event *>(buf + at);
+	    at += sizeof *e + e->len;
+	    if (e->mask & IN_Q_OVERFLOW) {
+		moved |= refresh();
+		continue;
+	    }
+	    auto found = watches.find(e->wd);
+	    if (found == watches.end()) {
+		continue;
+	    }
+	    auto &w = found->second;
+	    if (e->mask & IN_IGNORED) {
+		watches.erase(found);
+	    } else if (e->len) {
+		moved |= event(w, e->name, e->mask);
+	    }
+	}
+	return moved;
+    }
+
+    bool refresh() {
+	bool moved = false;
+	for (auto &w : watches) {
+	    moved |= relist(w.second);
+	}
+	return moved;
+    }
+
+  private:
+    const int fd;
+    std::unordered_map<int, Watched> watches;
+
+    static bool charge(Watched &w, const std::string &name, const size_t now,
+		       std::unordered_map<std::string, size_t> Watched::*in =
+			   &Watched::files) {
+	auto &before = (w.*in)[name];
+	if (now == before) {
+	    return false;
+	}
+	for (auto node : w.chain) {
+	    node->size = node->size - before + now;
+	}
+	before = now;
+	return true;
+    }
+
+    bool event(Watched &w, const std::string &name, const uint32_t mask) {
+	const auto path = w.path + (w.path.back() == '/' ? "" : "/") + name;
+	if ((mask & IN_ISDIR) && (mask & (IN_CREATE | IN_MOVED_TO))) {
+	    const bool watching = w.reported && add(path, w.chain, false, false);
+	    charge(w, name, beneath(path, !watching), &Watched::trees);
+	    return true;
+	}
+	if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+	    return departed(w, name, path);
+	}
+	if (mask & IN_ISDIR) {
+	    return false;
+	}
+	const bool gone = mask & (IN_DELETE | IN_MOVED_FROM);
+	const bool moved = charge(w, name, gone ? 0 : allocated(path));
+	if (gone) {
+	    w.files.erase(name);
+	}
+	return moved;
+    }
+
+    static std::unordered_map<std::string, size_t>
+    list(const std::string &path) {
+	std::unordered_map<std::string, size_t> files;
+	if (auto dirp = opendir(path.c_str())) {
+	    while (auto entry = readdir(dirp)) {
+		if (entry->d_type == DT_REG) {
+		    const std::string name = entry->d_name;
+		    files[name] = allocated(path + "/" + name);
+		}
+	    }
+	    closedir(dirp);
+	}
+	return files;
+    }
+
+    // takes back what was charged for a directory that has gone
+    bool departed(Watched &w, const std::string &name,
+		  const std::string &path) {
+	bool moved = charge(w, name, 0, &Watched::trees);
+	w.trees.erase(name);
+	for (auto i = watches.begin(); i != watches.end(); ++i) {
+	    auto &gone = i->second;
+	    if (gone.path != path) {
+		continue;
+	    }
+	    for (auto &f : gone.files) {
+		moved |= charge(gone, f.first, 0);
+	    }
+	    for (auto &t : gone.trees) {
+		moved |= charge(gone, t.first, 0, &Watched::trees);
+	    }
+	    inotify_rm_watch(fd, i->first);
+	    watches.erase(i);
+	    break;
+	}
+	return moved;
+    }
+
+    // lists the directory again, catching growth that raised no event
+    bool relist(Watched &w) {
+	const auto now = list(w.path);
+	bool moved = false;
+	for (auto &f : now) {
+	    moved |= charge(w, f.first, f.second);
+	}
+	for (auto i = w.files.begin(); i != w.files.end();) {
+	    if (now.count(i->first)) {
+		++i;
+		continue;
+	    }
+	    moved |= charge(w, i->first, 0);
+	    i = w.files.erase(i);
+	}
+	return moved;
+    }
+};
+
+void subdirectories(const std::string &path, std::vector<std::string> &out) {
+    if (auto dirp = opendir(path.c_str())) {
+	while (auto entry = readdir(dirp)) {
+	    const std::string name = entry->d_name;
+	    if (entry->d_type == DT_DIR && name != "." && name != "..") {
+		out.push_back(path + (path.back() == '/' ? "" : "/") + name);
+	    }
+	}
+	closedir(dirp);
+    }
+}
+
+} // namespace
+
+void watch_tree(const NodePtr &root, const size_t reportable_size,
+		const int interval, const std::function<void()> &report) {
+    Watcher watcher;
+
+    // the reported directories breadth first, each with its chain
+    std::vector<std::pair<Node *, std::vector<Node *>>> reported;
+    if (root->size > reportable_size) {
+	reported.push_back({root.get(), {root.get()}});
+    }
+    for (size_t i = 0; i < reported.size(); i++) {
+	for (auto &child : reported[i].first->children) {
+	    if (child->size > reportable_size) {
+		auto chain = reported[i].second;
+		chain.insert(chain.begin(), child.get());
+		reported.push_back({child.get(), chain});
+	    }
+	}
+    }
+
+    bool room = true;
+    for (auto &r : reported) {
+	room = room && watcher.add(r.first->fullpath, r.second, true);
+    }
+    std::unordered_set<std::string> watched;
+    for (auto &r : reported) {
+	watched.insert(r.first->fullpath);
+    }
+    for (size_t i = 0; room && i < reported.size(); i++) {
+	auto parent = reported[i].first;
+	std::vector<std::string> subdirs;
+	subdirectories(parent->fullpath, subdirs);
+	for (auto &s : subdirs) {
+	    if (!room || watched.count(s)) {
+		continue;
+	    }
+	    // a retained subdirectory has its own total to keep current
+	    auto chain = reported[i].second;
+	    for (auto &child : parent->children) {
+		if (child->fullpath == s) {
+		    chain.insert(chain.begin(), child.get());
+		}
+	    }
+	    room = watcher.add(s, chain, false);
+	}
+    }
+    ::fprintf(stderr, "watching %zu directories%s\n", watcher.size(),
+	      room ? "" : ", stopped at the inotify watch limit");
+
+    for (;;) {
+	const auto until = time(0) + interval;
+	bool moved = false;
+	for (time_t now; (now = time(0)) < until;) {
+	    moved |= watcher.wait(1000 * (until - now));
+	}
+	moved |= watcher.refresh();
+	if (moved) {
+	    char stamp[32];
+	    const time_t now = time(0);
+	    strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S", localtime(&now));
+	    ::printf("\n# %s\n", stamp);
+	    report();
+	    ::fflush(stdout);
+	}
+    }
+}